@@ -1,6 +1,8 @@
 #include <fstream>
 #include <string>
 #include <memory>
+#include <cinttypes>
+#include <chrono>
 
 #include <execution>
 #include <algorithm>
@@ -13,6 +15,7 @@
 #include "../common/reader.hpp"
 
 #include "timer.hpp"
+#include "tune.hpp"
 #include "btree_sort.hpp"
 
 #ifdef WINDOWS
@@ -23,6 +26,7 @@
 
 using std::string;
 using std::vector;
+using btreesort::Buffer;
 
 using std::unique_ptr;
 
@@ -34,6 +38,18 @@ void Work(DataType type, SortType sort, const FileReader& file);
 PerformanceTimer timer;
 
 size_t runCount = 1;
+size_t bucketsPerThread = 1;
+unique_ptr<btreesort::Executor> executor;
+
+// Only counted with -p, so the pages can be compared
+unique_ptr<TlbCounter> tlbCounter;
+
+// Arena chunk allocations of the last B-Tree Sort merge
+size_t mergeAllocs = 0;
+
+// With -a, the input is sorted as separate batches of this size
+size_t batchSize = 0;
+bool bFreshSorter = false;
 
 // ------------------------------------------------------------------------------
 
@@ -41,11 +57,12 @@ void PrintHelp()
 {
 	printf("Arguments: DataType Mode Input [option...]\n");
 	printf("    DataType can be any of:\n");
-	printf("        i32, u32, i64, u64, f64\n");
+	printf("        i8, u8, i16, u16, i32, u32, i64, u64, f64\n");
 	printf("    Mode can be:\n");
 	printf("        mw          Multiway Mergesort\n");
 	printf("        bq          Balanced Quicksort\n");
 	printf("        bt          B-Tree Sort\n");
+	printf("        rx          B-Tree Sort, radix bucket engine\n");
 	printf("    Input can be:\n");
 	printf("        -b FILE     Read input as binary file\n");
 	printf("        -t FILE     Read input as text file\n");
@@ -54,9 +71,53 @@ void PrintHelp()
 	printf("            c           Compact result\n");
 	printf("            v           Verbose result\n");
 	printf("        -n [num]    Repeat count\n");
+	printf("        -k [num]    B-Tree Sort buckets per thread\n");
+	printf("        -x [exec]   B-Tree Sort executor: omp, tbb, pool\n");
+	printf("        -p [mode]   Pages of the input and scratch buffers, also counts dTLB misses\n");
+	printf("            off         4 KB pages only\n");
+	printf("            thp         Transparent huge pages (default)\n");
+	printf("            tlb         Reserved huge pages, thp if there are none left\n");
+	printf("        -a [num]    Sort the input as batches of num, reports the time per batch\n");
+	printf("        -f          With -a, a new B-Tree Sort per batch instead of one reused\n");
+	printf("\n");
+	printf("Arguments: tune Output [option...]\n");
+	printf("    Writes a B-Tree Sort tuning profile to Output,\n");
+	printf("        load it by naming it btreesort.profile or setting BTREESORT_PROFILE\n");
+	printf("    Option can be:\n");
+	printf("        -s [num]    Largest size to tune, default 16777216\n");
+	printf("        -n [num]    Repeat count per candidate, default 3\n");
+}
+int MainTune(int argc, char** argv)
+{
+	size_t maxCount = 1 << 24;
+	size_t nRepeat = 3;
+
+	{
+		// Start parsing after Output arg
+		OptParse optParse(argc - 2, argv + 2);
+
+		if (auto opt = optParse.GetOptionParam("-s")) {
+			maxCount = strtoull(opt->get().c_str(), nullptr, 10);
+		}
+		if (auto opt = optParse.GetOptionParam("-n")) {
+			nRepeat = std::max<size_t>(strtoul(opt->get().c_str(), nullptr, 10), 1);
+		}
+	}
+
+	try {
+		RunTuner(argv[2], maxCount, nRepeat);
+	}
+	catch (const string& e) {
+		printf("Fatal error-> %s", e.c_str());
+	}
+
+	return 0;
 }
 int main(int argc, char** argv)
 {
+	if (argc >= 3 && strcmpi(argv[1], "tune") == 0) {
+		return MainTune(argc, argv);
+	}
 	if (argc < 4) {
 		PrintHelp();
 		return 0;
@@ -108,6 +169,68 @@ int main(int argc, char** argv)
 				return -1;
 			}
 		}
+
+		if (optParse.OptionExists("-k")) {
+			if (auto opt = optParse.GetOptionParam("-k")) {
+				bucketsPerThread = strtoul(opt->get().c_str(), nullptr, 10);
+			}
+			else {
+				printf("-k: Amount is required\n");
+				return -1;
+			}
+		}
+
+		if (optParse.OptionExists("-a")) {
+			if (auto opt = optParse.GetOptionParam("-a")) {
+				batchSize = strtoull(opt->get().c_str(), nullptr, 10);
+			}
+			else {
+				printf("-a: Batch size is required\n");
+				return -1;
+			}
+		}
+		bFreshSorter = optParse.OptionExists("-f");
+
+		// Before -x, so the counter sees the pool threads start
+		if (optParse.OptionExists("-p")) {
+			if (auto opt = optParse.GetOptionParam("-p")) {
+				const string& name = opt->get();
+				if (name == "off") 
+					btreesort::bs_HugePages() = btreesort::HugePages::Off;
+				else if (name == "thp") 
+					btreesort::bs_HugePages() = btreesort::HugePages::Transparent;
+				else if (name == "tlb") 
+					btreesort::bs_HugePages() = btreesort::HugePages::Reserved;
+				else {
+					printf("-p: Unknown page mode %s\n", name.c_str());
+					return -1;
+				}
+			}
+			else {
+				printf("-p: Page mode is required\n");
+				return -1;
+			}
+			tlbCounter.reset(new TlbCounter());
+		}
+
+		if (auto opt = optParse.GetOptionParam("-x")) {
+			const string& name = opt->get();
+			if (name == "omp") {
+				executor.reset(new btreesort::OpenMPExecutor());
+			}
+			else if (name == "pool") {
+				executor.reset(new btreesort::ThreadPoolExecutor(omp_get_num_procs()));
+			}
+#ifdef BS_HAS_TBB
+			else if (name == "tbb") {
+				executor.reset(new btreesort::TbbExecutor());
+			}
+#endif
+			else {
+				printf("-x: Unknown executor %s\n", name.c_str());
+				return -1;
+			}
+		}
 	}
 
 	DataType typeDataParse = GetDataTypeFromString(argv[1]);
@@ -134,13 +257,21 @@ int main(int argc, char** argv)
 
 // ------------------------------------------------------------------------------
 
+template<typename T> using Sorter = btreesort::BTreeSort<typename Buffer<T>::iterator, std::less<T>>;
+
+template<typename T> Buffer<T> ReadBuffer(const FileReader& file);
 template<typename T> void WorkGeneric(SortType sort, const FileReader& file);
-template<typename T> void PerformSort(SortType sort, vector<T>& res);
-template<typename T> void VerifySorted(vector<T>& data);
+template<typename T, typename Iter> void PerformSort(SortType sort, Iter begin, Iter end, 
+	Sorter<T>* pSorter);
+template<typename T> void VerifySorted(Buffer<T>& data, size_t batch);
 
 void Work(DataType type, SortType sort, const FileReader& file)
 {
 	switch (type) {
+	case DataType::i8: WorkGeneric<int8_t>(sort, file);		break;
+	case DataType::u8: WorkGeneric<uint8_t>(sort, file);		break;
+	case DataType::i16: WorkGeneric<int16_t>(sort, file);	break;
+	case DataType::u16: WorkGeneric<uint16_t>(sort, file);	break;
 	case DataType::i32: WorkGeneric<int32_t>(sort, file);	break;
 	case DataType::u32: WorkGeneric<uint32_t>(sort, file);	break;
 	case DataType::i64: WorkGeneric<int64_t>(sort, file);	break;
@@ -149,10 +280,36 @@ void Work(DataType type, SortType sort, const FileReader& file)
 	default: break;
 	}
 }
+
+// Binary input goes into memory first touched from every NUMA node in turn,
+//    the single-threaded read would otherwise place all of it on this thread's node
+template<typename T> Buffer<T> ReadBuffer(const FileReader& file)
+{
+	if (!file.binary) {
+		std::vector<T> data = file.ReadData<T>();
+		return Buffer<T>(data.begin(), data.end());
+	}
+	
+	Buffer<T> res(file.GetDataCount<T>());
+	btreesort::bs_FirstTouch(res.data(), res.size(), omp_get_num_procs(), 
+		btreesort::Executor::Default());
+	file.ReadData(res.data(), res.size());
+	return res;
+}
+
 template<typename T> void WorkGeneric(SortType sort, const FileReader& file)
 {
+	uint64_t tlbMisses = 0;
+	
+	// Lives across runs the way a service's sorter would, so only the first batch 
+	//    pays for its working memory
+	Sorter<T> sorter;
+	
+	size_t nBatches = 0;
+	std::chrono::duration<double> timeBatches {};
+	
 	for (size_t i = 0; i < runCount; ++i) {
-		vector<T> data = file.ReadData<T>();
+		Buffer<T> data = ReadBuffer<T>(file);
 		
 		if (i == 0) {
 			printf("Read %zu data from file (%zu bytes)\n", 
@@ -160,36 +317,85 @@ template<typename T> void WorkGeneric(SortType sort, const FileReader& file)
 			printf("Repeat: %zu\n", runCount);
 		}
 
+		size_t batch = batchSize > 0 ? batchSize : std::max<size_t>(data.size(), 1);
+
+		if (tlbCounter) tlbCounter->Start();
 		timer.Start();
+		auto timeBegin = std::chrono::steady_clock::now();
 		
-		PerformSort(sort, data);
+		if (batchSize == 0) {
+			PerformSort<T>(sort, data.begin(), data.end(), nullptr);
+		}
+		else {
+			for (size_t begin = 0; begin < data.size(); begin += batch) {
+				size_t end = std::min(begin + batch, data.size());
+				PerformSort<T>(sort, data.begin() + begin, data.begin() + end, 
+					bFreshSorter ? nullptr : &sorter);
+				++nBatches;
+			}
+		}
 		
+		timeBatches += std::chrono::steady_clock::now() - timeBegin;
 		auto stat = timer.Stop();
+		if (tlbCounter) tlbMisses += tlbCounter->Stop();
 		
 		timer.AddDataPoint(stat);
 
 		if (i == 0) {
-			VerifySorted(data);
+			VerifySorted(data, batch);
 		}
 	}
+	
+	if (batchSize > 0 && nBatches > 0) {
+		bool bBTree = sort == SortType::BTreeMerge || sort == SortType::BTreeRadix;
+		printf("Batches: %zu of %zu, %.2f us per batch%s\n", nBatches, batchSize,
+			timeBatches.count() * 1e6 / nBatches, 
+			!bBTree ? "" : bFreshSorter ? " (new sorter each)" : " (reused sorter)");
+	}
+
+	if (sort == SortType::BTreeMerge)
+		printf("Merge allocations: %zu in the last run\n", mergeAllocs);
+	if (tlbCounter) {
+		if (tlbCounter->IsOpen())
+			printf("dTLB load misses: %" PRIu64 " per run\n", tlbMisses / std::max<size_t>(runCount, 1));
+		else
+			printf("dTLB load misses: perf events unavailable\n");
+	}
 	std::cout << "\n";
 }
 
-template<typename T> void PerformSort(SortType sort, vector<T>& res)
+// B-Tree Sort goes through [pSorter] if it's given, else through a new sorter
+template<typename T, typename Iter> void PerformSort(SortType sort, Iter begin, Iter end, 
+	Sorter<T>* pSorter)
 {
 	switch (sort) {
 	case SortType::MultiwayMerge:
-		__gnu_parallel::sort(res.begin(), res.end(),
+		__gnu_parallel::sort(begin, end,
 			__gnu_parallel::multiway_mergesort_tag());
 		break;
 	case SortType::BalancedQuick:
-		__gnu_parallel::sort(res.begin(), res.end(),
+		__gnu_parallel::sort(begin, end,
 			__gnu_parallel::balanced_quicksort_tag());
 		break;
-	case SortType::BTreeMerge: {
-		btreesort::BTreeSort btreesort(
-			res.begin(), res.end(), std::less<T>());
-		btreesort.Sort();
+	case SortType::BTreeMerge: 
+	case SortType::BTreeRadix: {
+		auto settings = btreesort::Settings::Tuned<T>(std::distance(begin, end));
+		settings.nBucketsPerThread = bucketsPerThread;
+		settings.pExecutor = executor.get();
+		
+		auto engine = sort == SortType::BTreeRadix ? 
+			btreesort::SortEngine::Radix : btreesort::SortEngine::Comparison;
+		
+		if (pSorter) {
+			pSorter->SetSettings(settings);
+			pSorter->Sort(begin, end, engine);
+			mergeAllocs = pSorter->GetMergeAllocs();
+		}
+		else {
+			btreesort::BTreeSort btreesort(begin, end, std::less<T>(), settings);
+			btreesort.Sort(engine);
+			mergeAllocs = btreesort.GetMergeAllocs();
+		}
 		
 		break;
 	}
@@ -197,10 +403,14 @@ template<typename T> void PerformSort(SortType sort, vector<T>& res)
 	}
 }
 
-template<typename T> void VerifySorted(vector<T>& data)
+// Every batch of [batch] elements must be sorted on its own
+template<typename T> void VerifySorted(Buffer<T>& data, size_t batch)
 {
-	bool sorted = std::is_sorted(std::execution::par, 
-		data.cbegin(), data.cend(), std::less<T>());
+	bool sorted = true;
+	for (size_t begin = 0; begin < data.size() && sorted; begin += batch) {
+		sorted = std::is_sorted(std::execution::par, data.cbegin() + begin, 
+			data.cbegin() + std::min(begin + batch, data.size()), std::less<T>());
+	}
 	if (sorted) {
 		printf("Sort verified\n");
 	}
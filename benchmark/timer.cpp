@@ -2,6 +2,7 @@
 #include <sstream>
 #include <string>
 #include <iterator>
+#include <algorithm>
 #include <inttypes.h>
 
 #include "timer.hpp"
@@ -147,10 +148,24 @@ void PerformanceTimer::Report(std::ostream& out, bool compact, bool verbose) con
 			out << tmp;
 		}
 	};
-	auto _PrintStatAll = [&_Print](const Stat& stat) {
+	auto _PrintStatAll = [&](const Stat& stat) {
 		_Print(-1, stat.total_);
 		for (size_t i = 0; i < stat.cores_.size(); ++i)
 			_Print(i, stat.cores_[i]);
+
+		// Busy time of the busiest core over the average, 1.00 is perfectly even
+		uint64_t busyMax = 0, busySum = 0;
+		for (const auto& core : stat.cores_) {
+			uint64_t busy = core.user + core.sys;
+			busyMax = std::max(busyMax, busy);
+			busySum += busy;
+		}
+		if (busySum > 0) {
+			char tmp[64];
+			sprintf(tmp, "Imbalance: %.2f\n", 
+				(double)busyMax * stat.cores_.size() / busySum);
+			out << tmp;
+		}
 	};
 	
 	if (verbose)
@@ -229,3 +244,52 @@ PerformanceTimer::Stat PerformanceTimer::Stat::operator-(const Stat& obj) const
 	
 	return res;
 }
+
+
+// ------------------------------------------------------------------------------
+
+TlbCounter::TlbCounter()
+{
+	fd_ = -1;
+	begin_ = 0;
+	
+#if !defined(WINDOWS) && defined(__linux__)
+	perf_event_attr attr {};
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | 
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	
+	fd_ = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+}
+TlbCounter::~TlbCounter()
+{
+#if !defined(WINDOWS) && defined(__linux__)
+	if (fd_ >= 0)
+		close(fd_);
+#endif
+}
+
+uint64_t TlbCounter::_Read() const
+{
+	uint64_t value = 0;
+#if !defined(WINDOWS) && defined(__linux__)
+	// Inherited counters sum up the threads when read
+	if (fd_ >= 0 && read(fd_, &value, sizeof(value)) != sizeof(value))
+		value = 0;
+#endif
+	return value;
+}
+
+void TlbCounter::Start()
+{
+	begin_ = _Read();
+}
+uint64_t TlbCounter::Stop()
+{
+	return _Read() - begin_;
+}
\ No newline at end of file
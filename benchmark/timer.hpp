@@ -19,6 +19,12 @@
 	#include <winternl.h>
 #else
 	#include <unistd.h>
+	
+	#ifdef __linux__
+		#include <linux/perf_event.h>
+		#include <sys/syscall.h>
+		#include <sys/ioctl.h>
+	#endif
 #endif
 
 #ifdef WINDOWS
@@ -65,6 +71,23 @@ public:
 	void Report(std::ostream& out, bool compact = false, bool verbose = false) const;
 };
 
+// dTLB load misses of this process, counting the threads it starts after this is created
+// Reads nothing where perf events aren't supported or are not permitted
+class TlbCounter {
+	int fd_;
+	uint64_t begin_;
+	
+	uint64_t _Read() const;
+public:
+	TlbCounter();
+	~TlbCounter();
+	
+	bool IsOpen() const { return fd_ >= 0; }
+	
+	void Start();
+	uint64_t Stop();
+};
+
 class MyException : public std::runtime_error {
 	std::string msg_;
 public:
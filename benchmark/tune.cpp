@@ -0,0 +1,140 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+#include "tune.hpp"
+#include "btree_sort.hpp"
+
+using std::vector;
+
+using btreesort::Settings;
+using btreesort::TuningEntry;
+using btreesort::TuningProfile;
+
+// ------------------------------------------------------------------------------
+
+template<typename T> vector<T> MakeRandom(size_t count, std::mt19937_64& rng)
+{
+	vector<T> res(count);
+
+	if constexpr (std::is_floating_point_v<T>) {
+		std::uniform_real_distribution<T> dist(-1e9, 1e9);
+		for (auto& x : res) x = dist(rng);
+	}
+	else {
+		// uniform_int_distribution doesn't take 8-bit types, draw them as int
+		using DistType = std::conditional_t<sizeof(T) == 1, int, T>;
+
+		std::uniform_int_distribution<DistType> dist(
+			std::numeric_limits<T>::min(), std::numeric_limits<T>::max());
+		for (auto& x : res) x = (T)dist(rng);
+	}
+
+	return res;
+}
+
+// Best wall time of [nRepeat] sorts of [data], in seconds
+template<typename T> double TimeSort(const vector<T>& data, const Settings& settings, size_t nRepeat)
+{
+	vector<T> work(data.size());
+	double best = std::numeric_limits<double>::max();
+
+	for (size_t i = 0; i < nRepeat; ++i) {
+		std::copy(data.begin(), data.end(), work.begin());
+
+		auto begin = std::chrono::steady_clock::now();
+
+		btreesort::BTreeSort sorter(work.begin(), work.end(), std::less<T>(), settings);
+		sorter.Sort();
+
+		std::chrono::duration<double> time = std::chrono::steady_clock::now() - begin;
+		best = std::min(best, time.count());
+	}
+
+	return best;
+}
+
+// Coordinate descent, each parameter is swept with the others fixed at their best so far
+template<typename T> void TuneType(TuningProfile& profile, const vector<size_t>& sizes, size_t nRepeat)
+{
+	const Settings& defaults = Settings::get();
+	size_t nProcessors = defaults.nProcessors;
+
+	std::mt19937_64 rng(sizes.size() * sizeof(T));
+
+	for (size_t i = 0; i < sizes.size(); ++i) {
+		size_t count = sizes[i];
+		auto data = MakeRandom<T>(count, rng);
+
+		// Size classes start halfway between the tuned sizes, the first one covers everything below
+		TuningEntry best {
+			btreesort::bs_TypeTag<T>, i == 0 ? 0 : (sizes[i - 1] + count) / 2,
+			defaults.nSubBuckets, defaults.nMinPerSlice,
+		};
+
+		auto _Time = [&](const TuningEntry& entry) {
+			Settings s = defaults;
+			s.Apply(entry);
+			return TimeSort(data, s, nRepeat);
+		};
+		double bestTime = _Time(best);
+
+		auto _Sweep = [&](size_t TuningEntry::* pField, const vector<size_t>& candidates) {
+			for (size_t value : candidates) {
+				if (value == best.*pField) continue;
+
+				TuningEntry entry = best;
+				entry.*pField = value;
+
+				double time = _Time(entry);
+				if (time < bestTime) {
+					best = entry;
+					bestTime = time;
+				}
+			}
+		};
+
+		_Sweep(&TuningEntry::nSubBuckets, { 
+			std::max<size_t>(nProcessors / 2, 1), nProcessors, 
+			nProcessors * 2, nProcessors * 4, nProcessors * 8 });
+		_Sweep(&TuningEntry::nMinPerSlice, { 1, 2, 4, 8, 16 });
+
+		printf("%s %12zu: nSubBuckets %4zu, nMinPerSlice %2zu -> %.3f ms\n",
+			best.type.c_str(), count, best.nSubBuckets, best.nMinPerSlice, bestTime * 1000);
+		fflush(stdout);
+
+		profile.Add(best);
+	}
+}
+
+void RunTuner(const std::string& path, size_t maxCount, size_t nRepeat)
+{
+	vector<size_t> sizes;
+	for (size_t count = 1 << 16; count <= maxCount; count <<= 2) {
+		sizes.push_back(count);
+	}
+	if (sizes.empty())
+		sizes.push_back(maxCount);
+
+	TuningProfile profile;
+
+	TuneType<int8_t>(profile, sizes, nRepeat);
+	TuneType<uint8_t>(profile, sizes, nRepeat);
+	TuneType<int16_t>(profile, sizes, nRepeat);
+	TuneType<uint16_t>(profile, sizes, nRepeat);
+	TuneType<int32_t>(profile, sizes, nRepeat);
+	TuneType<uint32_t>(profile, sizes, nRepeat);
+	TuneType<int64_t>(profile, sizes, nRepeat);
+	TuneType<uint64_t>(profile, sizes, nRepeat);
+	TuneType<double>(profile, sizes, nRepeat);
+
+	if (!profile.Save(path))
+		throw std::string("Failed to open file for writing");
+
+	printf("Profile written to %s\n", path.c_str());
+}
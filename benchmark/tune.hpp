@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string>
+
+// Sweeps the B-Tree Sort parameters for every DataType over sizes up to [maxCount] 
+//    and writes the fastest ones per size class to the profile at [path]
+void RunTuner(const std::string& path, size_t maxCount, size_t nRepeat);
@@ -1,43 +1,113 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
+#include <array>
 #include <algorithm>
+#include <functional>
+#include <type_traits>
 
 #include <omp.h>
 
+#include "simd_sort.hpp"
+
 namespace btreesort {
+	// Comparisons are cheap enough that block partitioning beats branching on them
+	template<typename Iter, typename Comparator, 
+		typename ValType = typename std::iterator_traits<Iter>::value_type>
+	constexpr bool bs_IsBranchless = std::is_arithmetic_v<ValType> &&
+		(std::is_same_v<Comparator, std::less<ValType>> || 
+			std::is_same_v<Comparator, std::greater<ValType>> ||
+			std::is_same_v<Comparator, std::less<>> || 
+			std::is_same_v<Comparator, std::greater<>>);
+	
+	// Block partitioning from "BlockQuicksort: How Branch Mispredictions don't affect Quicksort" 
+	//    by Edelkamp and Weiss, following the layout of pdqsort
+	// Both ends record the offsets of misplaced elements into a small buffer without branching,
+	//    then the recorded pairs are swapped in one go
 	template<typename Iter, typename Pred>
-	Iter bs_Partition(Iter begin, Iter end, Pred pred)
+	Iter bs_BlockPartition(Iter first, Iter last, Pred pred)
 	{
-		auto i = begin;
-		for (auto j = begin; j != end; ++j) {
-			if (pred(*j)) {
-				std::swap(*i++, *j);
+		constexpr size_t BLOCK_SIZE = 64;
+		
+		alignas(64) unsigned char offsetsL[BLOCK_SIZE];
+		alignas(64) unsigned char offsetsR[BLOCK_SIZE];
+		
+		Iter baseL = first;
+		Iter baseR = last;
+		size_t numL = 0, numR = 0;
+		size_t startL = 0, startR = 0;
+		
+		while (first < last) {
+			// Only refill a side once all its recorded offsets have been swapped
+			size_t unknown = std::distance(first, last);
+			size_t splitL = numL == 0 ? (numR == 0 ? unknown / 2 : unknown) : 0;
+			size_t splitR = numR == 0 ? (unknown - splitL) : 0;
+			
+			splitL = std::min(splitL, BLOCK_SIZE);
+			splitR = std::min(splitR, BLOCK_SIZE);
+			
+			for (size_t i = 0; i < splitL; ++i) {
+				offsetsL[numL] = (unsigned char)i;
+				numL += !pred(*first);
+				++first;
+			}
+			for (size_t i = 0; i < splitR;) {
+				offsetsR[numR] = (unsigned char)++i;
+				numR += pred(*--last);
+			}
+			
+			size_t num = std::min(numL, numR);
+			if (numL == numR) {
+				// Plain swaps, a cyclic permutation here would make descending input quadratic
+				for (size_t i = 0; i < num; ++i) {
+					std::iter_swap(baseL + offsetsL[startL + i], baseR - offsetsR[startR + i]);
+				}
+			}
+			else if (num > 0) {
+				// Cyclic permutation, one move per element instead of three
+				Iter l = baseL + offsetsL[startL];
+				Iter r = baseR - offsetsR[startR];
+				auto tmp = std::move(*l);
+				*l = std::move(*r);
+				for (size_t i = 1; i < num; ++i) {
+					l = baseL + offsetsL[startL + i];
+					*r = std::move(*l);
+					r = baseR - offsetsR[startR + i];
+					*l = std::move(*r);
+				}
+				*r = std::move(tmp);
+			}
+			
+			numL -= num;
+			numR -= num;
+			startL += num;
+			startR += num;
+			
+			if (numL == 0) {
+				startL = 0;
+				baseL = first;
+			}
+			if (numR == 0) {
+				startR = 0;
+				baseR = last;
 			}
 		}
-		return i;
-	}
-	
-	template<bool ISORT, typename Iter, typename Comparator>
-	void bs_QuickSort(Iter begin, Iter end, Comparator comp, size_t cutoff)
-	{
-		if (begin == end) return;
 		
-		size_t dist = std::distance(begin, end);
-		if constexpr (ISORT) {
-			if (dist <= cutoff)
-				bs_InsertionSort(begin, end, comp);
+		// Whatever is left recorded on one side belongs to the other, move it across the boundary
+		if (numL > 0) {
+			while (numL--)
+				std::iter_swap(baseL + offsetsL[startL + numL], --last);
+			first = last;
+		}
+		if (numR > 0) {
+			while (numR--)
+				std::iter_swap(baseR - offsetsR[startR + numR], first++);
 		}
 		
-		auto pivot = *std::next(begin, dist / 2);
-		
-		Iter m1 = std::partition(begin, end, [&](const auto& x) { return comp(x, pivot); });
-		Iter m2 = std::partition(m1, end, [&](const auto& x) { return !comp(pivot, x); });
-		
-		bs_QuickSort<ISORT>(begin, m1, comp, cutoff);
-		bs_QuickSort<ISORT>(m2, end, comp, cutoff);
+		return first;
 	}
-
+	
 	// https://github.com/karottc/sgi-stl/blob/b3e4ad93382ac8b47ba1eb8b409917ea1ff8a8b5/stl_algo.h#L1300
 	template<typename Iter, 
 		typename ValType = typename std::iterator_traits<Iter>::value_type,
@@ -46,13 +116,13 @@ namespace btreesort {
 	{
 		auto next = last;
 		--next;
-
+		
 		while (comp(val, *next)) {
 			*last = *next;
 			last = next;
 			--next;
 		}
-
+		
 		*last = val;
 	}
 	template<typename Iter, typename Comparator>
@@ -71,4 +141,491 @@ namespace btreesort {
 			}
 		}
 	}
-}
\ No newline at end of file
+	
+	// Insertion sort for a range where *(begin - 1) is not greater than any of its elements
+	template<typename Iter, typename Comparator>
+	void bs_UnguardedInsertionSort(Iter begin, Iter end, Comparator comp)
+	{
+		if (begin == end) return;
+		
+		for (auto i = begin + 1; i != end; ++i) {
+			if (comp(*i, *(i - 1)))
+				bs_UnguardedLinearInsert(i, *i, comp);
+		}
+	}
+	
+	// Sorts the leaves of bs_QuickSort, with the sorting network when the key type allows
+	template<typename Iter, typename Comparator>
+	void bs_SmallSort(Iter begin, Iter end, Comparator comp, bool bLeftmost)
+	{
+		if constexpr (bs_HasNetworkSort<Iter, Comparator>) {
+			size_t size = std::distance(begin, end);
+			if (size > BS_NETWORK_SORT_MIN / 2 && size <= BS_NETWORK_SORT_MAX) {
+				bs_NetworkSort(begin, end);
+				return;
+			}
+		}
+		
+		if (bLeftmost)
+			bs_InsertionSort(begin, end, comp);
+		else
+			bs_UnguardedInsertionSort(begin, end, comp);
+	}
+	
+	// Insertion sort that gives up after moving more than [limit] elements
+	// Returns whether the range ended up sorted
+	template<typename Iter, typename Comparator>
+	bool bs_PartialInsertionSort(Iter begin, Iter end, Comparator comp, size_t limit = 8)
+	{
+		if (begin == end) return true;
+		
+		size_t moves = 0;
+		for (auto i = begin + 1; i != end; ++i) {
+			if (!comp(*i, *(i - 1))) continue;
+			
+			auto val = *i;
+			auto j = i;
+			do {
+				*j = *(j - 1);
+				--j;
+			} while (j != begin && comp(val, *(j - 1)));
+			*j = val;
+			
+			moves += std::distance(j, i);
+			if (moves > limit) return false;
+		}
+		return true;
+	}
+	
+	template<typename Iter, typename Comparator>
+	void bs_HeapSort(Iter begin, Iter end, Comparator comp)
+	{
+		std::make_heap(begin, end, comp);
+		std::sort_heap(begin, end, comp);
+	}
+	
+	template<typename Iter, typename Comparator>
+	inline void bs_Sort3(Iter a, Iter b, Iter c, Comparator comp)
+	{
+		if (comp(*b, *a)) std::iter_swap(a, b);
+		if (comp(*c, *b)) std::iter_swap(b, c);
+		if (comp(*b, *a)) std::iter_swap(a, b);
+	}
+	
+	// Partitions around the pivot in *begin, elements equal to it go to the right
+	// Requires an element not less than the pivot at end - 1
+	// Returns the final pivot position, and whether no elements had to be swapped
+	template<typename Iter, typename Comparator>
+	std::pair<Iter, bool> bs_PartitionRight(Iter begin, Iter end, Comparator comp)
+	{
+		auto pivot = *begin;
+		
+		Iter first = begin;
+		Iter last = end;
+		
+		while (comp(*++first, pivot));
+		
+		// Nothing guards the right scan if the first element was already misplaced
+		if (first - 1 == begin) {
+			while (first < last && !comp(*--last, pivot));
+		}
+		else {
+			while (!comp(*--last, pivot));
+		}
+		
+		bool bPartitioned = first >= last;
+		
+		while (first < last) {
+			std::iter_swap(first, last);
+			while (comp(*++first, pivot));
+			while (!comp(*--last, pivot));
+		}
+		
+		Iter itrPivot = first - 1;
+		*begin = *itrPivot;
+		*itrPivot = pivot;
+		
+		return { itrPivot, bPartitioned };
+	}
+	
+	// bs_PartitionRight with the scan after the first misplaced pair done by bs_BlockPartition
+	template<typename Iter, typename Comparator>
+	std::pair<Iter, bool> bs_PartitionRightBranchless(Iter begin, Iter end, Comparator comp)
+	{
+		auto pivot = *begin;
+		
+		Iter first = begin;
+		Iter last = end;
+		
+		while (comp(*++first, pivot));
+		
+		if (first - 1 == begin) {
+			while (first < last && !comp(*--last, pivot));
+		}
+		else {
+			while (!comp(*--last, pivot));
+		}
+		
+		bool bPartitioned = first >= last;
+		
+		if (!bPartitioned) {
+			std::iter_swap(first, last);
+			first = bs_BlockPartition(first + 1, last, 
+				[&](const auto& x) { return comp(x, pivot); });
+		}
+		
+		Iter itrPivot = first - 1;
+		*begin = *itrPivot;
+		*itrPivot = pivot;
+		
+		return { itrPivot, bPartitioned };
+	}
+	
+	// Partitions around the pivot in *begin, elements equal to it go to the left
+	// Used when the pivot equals the element before the range, so the left side is all equal
+	template<typename Iter, typename Comparator>
+	Iter bs_PartitionLeft(Iter begin, Iter end, Comparator comp)
+	{
+		auto pivot = *begin;
+		
+		Iter first = begin;
+		Iter last = end;
+		
+		while (comp(pivot, *--last));
+		
+		if (last + 1 == end) {
+			while (first < last && !comp(pivot, *++first));
+		}
+		else {
+			while (!comp(pivot, *++first));
+		}
+		
+		while (first < last) {
+			std::iter_swap(first, last);
+			while (comp(pivot, *--last));
+			while (!comp(pivot, *++first));
+		}
+		
+		*begin = *last;
+		*last = pivot;
+		
+		return last;
+	}
+	
+	// Runs everything on the calling thread
+	struct bs_NoSpawner {
+		template<typename F> void Run(F&& fn) { fn(); }
+	};
+	
+	// Pattern-defeating quicksort, see https://github.com/orlp/pdqsort
+	// Subranges larger than a non-zero [nTaskGrain] are handed to [pSpawner]->Run() as tasks,
+	//    the caller waits for them however the spawner's task group does
+	template<typename Iter, typename Comparator, typename Spawner>
+	void bs_QuickSortLoop(Iter begin, Iter end, Comparator comp, size_t cutoff, 
+		int badAllowed, bool bLeftmost, size_t nTaskGrain, Spawner* pSpawner)
+	{
+		constexpr size_t NINTHER_THRESHOLD = 128;
+		constexpr size_t SHUFFLE_THRESHOLD = 24;
+		
+		while (true) {
+			size_t size = std::distance(begin, end);
+			
+			if (size <= cutoff) {
+				bs_SmallSort(begin, end, comp, bLeftmost);
+				return;
+			}
+			
+			// Move the pivot into *begin, median of 3 or pseudo-median of 9 for larger ranges
+			{
+				size_t s2 = size / 2;
+				if (size > NINTHER_THRESHOLD) {
+					bs_Sort3(begin, begin + s2, end - 1, comp);
+					bs_Sort3(begin + 1, begin + (s2 - 1), end - 2, comp);
+					bs_Sort3(begin + 2, begin + (s2 + 1), end - 3, comp);
+					bs_Sort3(begin + (s2 - 1), begin + s2, begin + (s2 + 1), comp);
+					std::iter_swap(begin, begin + s2);
+				}
+				else {
+					bs_Sort3(begin + s2, begin, end - 1, comp);
+				}
+			}
+			
+			// The pivot equals an element left of the range, so everything equal to it is 
+			//    already in place once partitioned to the left
+			if (!bLeftmost && !comp(*(begin - 1), *begin)) {
+				begin = bs_PartitionLeft(begin, end, comp) + 1;
+				continue;
+			}
+			
+			std::pair<Iter, bool> partition;
+			if constexpr (bs_IsBranchless<Iter, Comparator>)
+				partition = bs_PartitionRightBranchless(begin, end, comp);
+			else
+				partition = bs_PartitionRight(begin, end, comp);
+			auto [itrPivot, bPartitioned] = partition;
+			
+			size_t sizeL = std::distance(begin, itrPivot);
+			size_t sizeR = std::distance(itrPivot + 1, end);
+			
+			if (sizeL < size / 8 || sizeR < size / 8) {
+				// Too many bad pivots, fall back to heapsort for guaranteed n log n
+				if (--badAllowed == 0) {
+					bs_HeapSort(begin, end, comp);
+					return;
+				}
+				
+				// Swap a few elements around to break up patterns
+				if (sizeL >= SHUFFLE_THRESHOLD) {
+					std::iter_swap(begin, begin + sizeL / 4);
+					std::iter_swap(itrPivot - 1, itrPivot - sizeL / 4);
+					if (sizeL > NINTHER_THRESHOLD) {
+						std::iter_swap(begin + 1, begin + (sizeL / 4 + 1));
+						std::iter_swap(begin + 2, begin + (sizeL / 4 + 2));
+						std::iter_swap(itrPivot - 2, itrPivot - (sizeL / 4 + 1));
+						std::iter_swap(itrPivot - 3, itrPivot - (sizeL / 4 + 2));
+					}
+				}
+				if (sizeR >= SHUFFLE_THRESHOLD) {
+					std::iter_swap(itrPivot + 1, itrPivot + (1 + sizeR / 4));
+					std::iter_swap(end - 1, end - sizeR / 4);
+					if (sizeR > NINTHER_THRESHOLD) {
+						std::iter_swap(itrPivot + 2, itrPivot + (2 + sizeR / 4));
+						std::iter_swap(itrPivot + 3, itrPivot + (3 + sizeR / 4));
+						std::iter_swap(end - 2, end - (1 + sizeR / 4));
+						std::iter_swap(end - 3, end - (2 + sizeR / 4));
+					}
+				}
+			}
+			else if (bPartitioned) {
+				// Balanced and nothing was swapped, the range is likely already sorted
+				if (bs_PartialInsertionSort(begin, itrPivot, comp) &&
+					bs_PartialInsertionSort(itrPivot + 1, end, comp))
+					return;
+			}
+			
+			// Recurse into the smaller side and loop on the larger one to bound stack depth
+			Iter itrSideBegin = begin, itrSideEnd = itrPivot;
+			bool bSideLeftmost = bLeftmost;
+			if (sizeL < sizeR) {
+				begin = itrPivot + 1;
+				bLeftmost = false;
+			}
+			else {
+				itrSideBegin = itrPivot + 1;
+				itrSideEnd = end;
+				bSideLeftmost = false;
+				end = itrPivot;
+			}
+			
+			if (pSpawner && nTaskGrain > 0 && std::min(sizeL, sizeR) > nTaskGrain) {
+				// Left for any idle thread to pick up, the sides never overlap
+				pSpawner->Run([=]() {
+					bs_QuickSortLoop(itrSideBegin, itrSideEnd, comp, cutoff, badAllowed, 
+						bSideLeftmost, nTaskGrain, pSpawner);
+				});
+			}
+			else {
+				bs_QuickSortLoop(itrSideBegin, itrSideEnd, comp, cutoff, badAllowed, 
+					bSideLeftmost, nTaskGrain, pSpawner);
+			}
+		}
+	}
+	template<typename Iter, typename Comparator, typename Spawner = bs_NoSpawner>
+	void bs_QuickSort(Iter begin, Iter end, Comparator comp, size_t cutoff, 
+		size_t nTaskGrain = 0, Spawner* pSpawner = nullptr)
+	{
+		size_t size = std::distance(begin, end);
+		if (size < 2) return;
+		
+		// Pivot selection needs at least 3 elements
+		cutoff = std::max<size_t>(cutoff, 2);
+		
+		int badAllowed = 0;
+		for (size_t n = size; n > 1; n >>= 1)
+			++badAllowed;
+		
+		bs_QuickSortLoop(begin, end, comp, cutoff, badAllowed, true, nTaskGrain, pSpawner);
+	}
+	
+	// Finds the positions that split the sorted sequences [seqs] so that exactly [rank] elements
+	//    lie on the left, and nothing on the left compares greater than anything on the right
+	// Equal keys are taken in sequence order, so splits of increasing ranks never cross
+	template<typename Iter, typename Comparator>
+	std::vector<size_t> bs_MultiSequenceSelect(const std::vector<std::array<Iter, 2>>& seqs,
+		size_t rank, Comparator comp)
+	{
+		size_t nSeqs = seqs.size();
+		
+		// Window [lo, hi) of every sequence that still contains its split position
+		std::vector<size_t> lo(nSeqs, 0), hi(nSeqs);
+		for (size_t j = 0; j < nSeqs; ++j)
+			hi[j] = std::distance(seqs[j][0], seqs[j][1]);
+		
+		std::vector<size_t> less(nSeqs), lessEq(nSeqs);
+		std::vector<std::pair<Iter, size_t>> mids;
+		mids.reserve(nSeqs);
+		
+		while (true) {
+			size_t weight = 0;
+			
+			mids.clear();
+			for (size_t j = 0; j < nSeqs; ++j) {
+				if (hi[j] > lo[j]) {
+					mids.push_back({ seqs[j][0] + (lo[j] + hi[j]) / 2, hi[j] - lo[j] });
+					weight += hi[j] - lo[j];
+				}
+			}
+			if (weight == 0) break;
+			
+			// Pivot on the weighted median of the window midpoints, this discards at least 
+			//    a quarter of the remaining windows every round
+			std::sort(mids.begin(), mids.end(), 
+				[&](const auto& a, const auto& b) { return comp(*a.first, *b.first); });
+			
+			Iter itrPivot = mids.back().first;
+			{
+				size_t acc = 0;
+				for (auto& [itr, w] : mids) {
+					acc += w;
+					if (acc * 2 >= weight) {
+						itrPivot = itr;
+						break;
+					}
+				}
+			}
+			auto pivot = *itrPivot;
+			
+			// Global rank of the pivot
+			size_t nLess = 0, nLessEq = 0;
+			for (size_t j = 0; j < nSeqs; ++j) {
+				auto& [begin, end] = seqs[j];
+				auto itrLess = std::lower_bound(begin, end, pivot, comp);
+				auto itrLessEq = std::upper_bound(itrLess, end, pivot, comp);
+				
+				nLess += (less[j] = std::distance(begin, itrLess));
+				nLessEq += (lessEq[j] = std::distance(begin, itrLessEq));
+			}
+			
+			if (rank < nLess) {
+				for (size_t j = 0; j < nSeqs; ++j)
+					hi[j] = std::min(hi[j], less[j]);
+			}
+			else if (rank > nLessEq) {
+				for (size_t j = 0; j < nSeqs; ++j)
+					lo[j] = std::max(lo[j], lessEq[j]);
+			}
+			else {
+				// The pivot is the split key, take everything below it 
+				//    then fill the remainder with its duplicates
+				size_t remain = rank - nLess;
+				for (size_t j = 0; j < nSeqs; ++j) {
+					size_t take = std::min(remain, lessEq[j] - less[j]);
+					lo[j] = less[j] + take;
+					remain -= take;
+				}
+				break;
+			}
+		}
+		
+		return lo;
+	}
+	
+	// upper_bound for a [val] expected near the front of [begin, end), which must not be empty 
+	//    and start with an element not greater than [val]
+	// Costs O(log n) for a result n places in, regardless of the range's size
+	template<typename Iter, typename T, typename Comparator>
+	Iter bs_GallopUpperBound(Iter begin, Iter end, const T& val, Comparator comp)
+	{
+		size_t size = std::distance(begin, end);
+		
+		// begin[lo] is never greater than val
+		size_t lo = 0, hi = 1;
+		while (hi < size && !comp(val, begin[hi])) {
+			lo = hi;
+			hi = hi * 2 + 1;
+		}
+		
+		return std::upper_bound(begin + lo + 1, begin + std::min(hi, size), val, comp);
+	}
+	
+	// Adjacent pairs of a range that descend and that ascend, equal pairs count as neither
+	struct bs_Order {
+		size_t nDescents;
+		size_t nAscents;
+		
+		// Neither sorted, reversed nor nearly sorted, the counts weren't finished
+		static bs_Order Unordered() { return { SIZE_MAX, SIZE_MAX }; }
+		
+		bool IsSorted() const { return nDescents == 0; }
+		bool IsReversed() const { return nAscents == 0; }
+		bool IsUnordered() const { return nDescents == SIZE_MAX; }
+	};
+	
+	// Counts the descents and ascents of [begin, end), or returns bs_Order::Unordered() once 
+	//    the range can't be reversed and has more than [nMaxDescents] descents
+	// Also gives up early once the scanned prefix has twice the descents per element 
+	//    [nMaxDescents] allows for the whole range, a range that disordered at its start 
+	//    is rarely nearly sorted overall, and random data then costs a block or two 
+	//    instead of a full pass
+	template<typename Iter, typename Comparator>
+	bs_Order bs_ScanOrder(Iter begin, Iter end, Comparator comp, size_t nMaxDescents)
+	{
+		constexpr size_t BLOCK = 1024;
+		
+		bs_Order res { 0, 0 };
+		size_t n = std::distance(begin, end);
+		
+		// Give-up test once per block, so the inner loop has no early exit
+		for (size_t i = 1; i < n; i += BLOCK) {
+			size_t iEnd = std::min(i + BLOCK, n);
+			for (size_t j = i; j < iEnd; ++j) {
+				res.nDescents += comp(begin[j], begin[j - 1]);
+				res.nAscents += comp(begin[j - 1], begin[j]);
+			}
+			
+			if (res.nAscents > 0 && (res.nDescents > nMaxDescents || 
+				res.nDescents * n > 2 * nMaxDescents * iEnd))
+				return bs_Order::Unordered();
+		}
+		
+		return res;
+	}
+	
+	// Makes a nearly sorted range into two sorted runs, the elements that break its order 
+	//    are moved behind the rest and sorted there, see "Splitsort - an adaptive sorting 
+	//    algorithm" by Levcopoulos and Petersson
+	// An element less than the last one kept is set aside together with that one, 
+	//    so the kept elements stay in order
+	// Returns where the set-aside run begins, and false with the range left unordered if 
+	//    more than [nMaxStrays] would be set aside
+	// [strays] is working memory
+	template<typename Iter, typename Comparator, 
+		typename ValType = typename std::iterator_traits<Iter>::value_type>
+	std::pair<Iter, bool> bs_SplitStrays(Iter begin, Iter end, Comparator comp, size_t cutoff, size_t nMaxStrays, 
+		std::vector<ValType>& strays)
+	{
+		strays.clear();
+		
+		Iter itrKept = begin;
+		for (Iter itr = begin; itr != end; ++itr) {
+			if (itrKept != begin && comp(*itr, *(itrKept - 1))) {
+				strays.push_back(std::move(*--itrKept));
+				strays.push_back(std::move(*itr));
+				
+				if (strays.size() > nMaxStrays) {
+					// Every element goes back into the range, in no particular order
+					itrKept = std::move(itr + 1, end, itrKept);
+					std::move(strays.begin(), strays.end(), itrKept);
+					return { end, false };
+				}
+			}
+			else {
+				*itrKept++ = std::move(*itr);
+			}
+		}
+		
+		bs_QuickSort(strays.begin(), strays.end(), comp, cutoff);
+		std::move(strays.begin(), strays.end(), itrKept);
+		return { itrKept, true };
+	}
+}
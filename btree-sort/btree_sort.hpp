@@ -3,9 +3,12 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <memory>
+#include <cstdint>
 #include <array>
 #include <algorithm>
 #include <queue>
+#include <type_traits>
 
 #include <omp.h>
 
@@ -13,84 +16,311 @@
 
 //#define USE_STD_SET
 //#define USE_STD_HEAP
+//#define USE_BTREE_HEAP
 
+// Ordered set behind MultiwayTreeSet, the heap of values the loser tree can't hold
 #ifdef USE_STD_SET
 	#include <set>
-	template<typename T> using set_t = std::set<T>;
+	template<typename T, typename Comparator, typename Alloc> 
+	using multiset_t = std::multiset<T, Comparator, Alloc>;
 #else
 	#include "cpp-btree/btree/set.h"
-	template<typename T> using set_t = btree::set<T>;
+	template<typename T, typename Comparator, typename Alloc> 
+	using multiset_t = btree::multiset<T, Comparator, Alloc>;
 #endif
 
 #include "algo.hpp"
+#include "radix_sort.hpp"
+#include "counting_sort.hpp"
+#include "profile.hpp"
+#include "executor.hpp"
+#include "memory.hpp"
+#include "numa.hpp"
 
 // ------------------------------------------------------------------------------
 
 namespace btreesort {
-#ifdef USE_STD_HEAP
-	template<typename ValType, typename Comparator> class MultiwaySet {
-		struct comp_reverse {
-			constexpr bool operator()(const ValType& x, const ValType& y) const
-			{
-				return !Comparator()(x, y);
-			}
+	// Tournament tree over a fixed set of sources, every output element costs one replay 
+	//    from its leaf to the root
+	// Pop() and a following Push() of the same source's next value are fused into that replay, 
+	//    a Pop() not followed by a Push() retires the source
+	template<typename ValType, typename Comparator, typename Alloc = std::allocator<ValType>> 
+	class MultiwayLoserTree {
+		static_assert(std::is_trivially_copyable_v<ValType>,
+			"MultiwayLoserTree stores values inline and requires trivially copyable types");
+		
+		template<typename T> using _Vector = std::vector<T, 
+			typename std::allocator_traits<Alloc>::template rebind_alloc<T>>;
+		
+		struct Leaf {
+			ValType val;
+			bool bLive;
 		};
-		std::priority_queue<ValType, std::vector<ValType>, comp_reverse> heap;
+		_Vector<Leaf> leaves;
+		
+		// losers[0] is the current winner, losers[1..k) hold the loser of each match
+		_Vector<size_t> losers;
+		
+		bool bBuilt = false;
+		bool bPending = false;
 	public:
-		MultiwaySet() = default;
-
-		void Push(const ValType& v) { heap.push(v); }
-		void Push(ValType&& v) { heap.push(std::move(v)); }
-
-		bool Empty() const { return heap.empty(); }
-
-		const ValType& Peek() const { return heap.top(); }
+		explicit MultiwayLoserTree(const Alloc& alloc = Alloc()) : leaves(alloc), losers(alloc) {}
+		
+		void Push(const ValType& v)
+		{
+			if (bPending) {
+				// Refill the leaf that just won
+				size_t i = losers[0];
+				leaves[i] = { v, true };
+				bPending = false;
+				_Replay(i);
+			}
+			else {
+				leaves.push_back({ v, true });
+				bBuilt = false;
+			}
+		}
+		
+		bool Empty()
+		{
+			_Settle();
+			return leaves.empty() || !leaves[losers[0]].bLive;
+		}
+		
+		const ValType& Peek()
+		{
+			_Settle();
+			return leaves[losers[0]].val;
+		}
 		ValType Pop()
 		{
-			ValType val = std::move(Peek());
-			heap.pop();
+			ValType val = Peek();
+			bPending = true;
 			return val;
 		}
+		
+		// Value that would win if the current winner were retired, null if there's none
+		// Only losers on the winner's path can be second, the rest lost to one of them
+		const ValType* PeekSecond()
+		{
+			_Settle();
+			
+			size_t k = leaves.size();
+			size_t w = losers[0];
+			if (k < 2 || !leaves[w].bLive) return nullptr;
+			
+			size_t best = losers[(k + w) / 2];
+			for (size_t n = (k + w) / 4; n > 0; n /= 2) {
+				if (_Beats(losers[n], best))
+					best = losers[n];
+			}
+			return leaves[best].bLive ? &leaves[best].val : nullptr;
+		}
+	private:
+		bool _Beats(size_t a, size_t b) const
+		{
+			if (!leaves[a].bLive) return false;
+			if (!leaves[b].bLive) return true;
+			return Comparator()(leaves[a].val, leaves[b].val);
+		}
+		
+		void _Settle()
+		{
+			if (!bBuilt) {
+				_Build();
+			}
+			else if (bPending) {
+				// Source of the last popped value ran out
+				size_t i = losers[0];
+				leaves[i].bLive = false;
+				bPending = false;
+				_Replay(i);
+			}
+		}
+		void _Build()
+		{
+			size_t k = leaves.size();
+			bBuilt = true;
+			bPending = false;
+			
+			losers.assign(std::max<size_t>(k, 1), 0);
+			if (k == 0) return;
+			
+			// Implicit layout: leaf i is node k + i, node n plays its children 2n and 2n + 1
+			_Vector<size_t> winners(k * 2, losers.get_allocator());
+			for (size_t i = 0; i < k; ++i)
+				winners[k + i] = i;
+			for (size_t n = k - 1; n > 0; --n) {
+				size_t a = winners[n * 2], b = winners[n * 2 + 1];
+				if (_Beats(b, a)) std::swap(a, b);
+				winners[n] = a;
+				losers[n] = b;
+			}
+			losers[0] = winners[1];
+		}
+		void _Replay(size_t i)
+		{
+			size_t k = leaves.size();
+			size_t winner = i;
+			for (size_t n = (k + i) / 2; n > 0; n /= 2) {
+				if (_Beats(losers[n], winner))
+					std::swap(losers[n], winner);
+			}
+			losers[0] = winner;
+		}
 	};
-#else
-	template<typename ValType, typename Comparator> class MultiwaySet {
-		btree::multiset<ValType, Comparator> heap;
+	
+	// Ordered set of the sources' heads, takes values of any type
+	template<typename ValType, typename Comparator, typename Alloc = std::allocator<ValType>> 
+	class MultiwayTreeSet {
+		multiset_t<ValType, Comparator, Alloc> heap;
 	public:
-		MultiwaySet() = default;
-
+		explicit MultiwayTreeSet(const Alloc& alloc = Alloc()) : heap(Comparator(), alloc) {}
+		
 		void Push(const ValType& v) { heap.insert(v); }
 		void Push(ValType&& v) { heap.insert(std::move(v)); }
-
+		
 		bool Empty() const { return heap.empty(); }
-
+		
 		const ValType& Peek() const { return *heap.begin(); }
 		ValType Pop() {
 			ValType val = std::move(Peek());
 			heap.erase(heap.begin());
 			return val;
 		}
+		
+		const ValType* PeekSecond() const
+		{
+			if (heap.size() < 2) return nullptr;
+			return &*std::next(heap.begin());
+		}
+	};
+
+#if defined(USE_STD_HEAP)
+	template<typename ValType, typename Comparator, typename Alloc = std::allocator<ValType>> 
+	class MultiwaySet {
+		struct comp_reverse {
+			constexpr bool operator()(const ValType& x, const ValType& y) const
+			{
+				return !Comparator()(x, y);
+			}
+		};
+		// Plain vector heap rather than std::priority_queue, so the top's children are reachable
+		std::vector<ValType, Alloc> heap;
+	public:
+		explicit MultiwaySet(const Alloc& alloc = Alloc()) : heap(alloc) {}
+		
+		void Push(const ValType& v)
+		{
+			heap.push_back(v);
+			std::push_heap(heap.begin(), heap.end(), comp_reverse());
+		}
+		void Push(ValType&& v)
+		{
+			heap.push_back(std::move(v));
+			std::push_heap(heap.begin(), heap.end(), comp_reverse());
+		}
+		
+		bool Empty() const { return heap.empty(); }
+		
+		const ValType& Peek() const { return heap.front(); }
+		ValType Pop()
+		{
+			ValType val = std::move(heap.front());
+			std::pop_heap(heap.begin(), heap.end(), comp_reverse());
+			heap.pop_back();
+			return val;
+		}
+		
+		const ValType* PeekSecond() const
+		{
+			if (heap.size() < 2) return nullptr;
+			if (heap.size() == 2 || Comparator()(heap[1], heap[2])) return &heap[1];
+			return &heap[2];
+		}
 	};
+#elif defined(USE_BTREE_HEAP)
+	template<typename ValType, typename Comparator, typename Alloc = std::allocator<ValType>>
+	using MultiwaySet = MultiwayTreeSet<ValType, Comparator, Alloc>;
+#else
+	// The loser tree holds its values inline, other values stay in the ordered set
+	template<typename ValType, typename Comparator, typename Alloc = std::allocator<ValType>>
+	using MultiwaySet = std::conditional_t<std::is_trivially_copyable_v<ValType>,
+		MultiwayLoserTree<ValType, Comparator, Alloc>, MultiwayTreeSet<ValType, Comparator, Alloc>>;
 #endif
 }
 
 // ------------------------------------------------------------------------------
 
 namespace btreesort {
+	// How each bucket gets sorted
+	// Integer keys under std::less spanning fewer than BS_COUNTING_RANGE values 
+	//    are counting sorted with either engine
+	enum class SortEngine {
+		Comparison,		// Per-bucket quicksort, then the multiway merge
+		Radix,			// MSD radix partitioning then LSD radix, numeric keys under std::less 
+						//    in contiguous ranges only
+	};
+	
+	// Wins in a row after which a slice's run is copied in bulk instead of one element at a time
+	constexpr size_t BS_MERGE_GALLOP = 8;
+	
+	// Buckets with at most one descent per this many elements are made into two sorted runs 
+	//    by bs_SplitStrays instead of being quicksorted
+	constexpr size_t BS_PRESORTED_DESCENTS = 8;
+	
+	// bs_SplitStrays gives up once more than one element in this many is set aside
+	constexpr size_t BS_PRESORTED_STRAYS = 3;
+	
 	struct Settings {
 		size_t nProcessors;
 		size_t nSubBuckets;
 		size_t nMinPerSlice;
 		size_t nParallelCutoff;
 		size_t nQuickSortCutoff;
-		size_t nMaxHeapSize;
-
+		size_t nNetworkSortCutoff;
+		
+		// Groups of exact splitters, a group larger than a thread's share is split 
+		//    again and merged by several threads
+		size_t nMergeGroups;
+		
+		// Quicksort subranges larger than this can be stolen by idle threads, 0 disables it
+		size_t nTaskGrain;
+		
+		// Buckets made per thread, more buckets even out slow cores but widen the merge
+		size_t nBucketsPerThread;
+		
+		// Runs the parallel phases, null uses Executor::Default()
+		Executor* pExecutor;
+		
+		// Scans the buckets for existing order first, sorted or reversed input then takes 
+		//    one pass and nearly sorted buckets skip the quicksort
+		bool bDetectPresorted;
+		
+		// Sorts 64-bit integer keys spanning less than 2^32 as 32-bit offsets from 
+		//    the minimum, which pays off once the sort is bound by memory bandwidth
+		bool bNarrowKeys;
+		
+		// Binds the threads sorting buckets and merging to the node their memory is on, 
+		//    and spreads the owned scratch buffer over all nodes
+		// On by default if the machine has more than one node
+		bool bNumaAware;
+		
 		Settings();
+		explicit Settings(size_t nThreads);
+		
+		// Overrides the tunable parameters and recomputes the ones derived from them
+		void Apply(const TuningEntry& entry);
 		
+		// Defaults for this machine, used by every BTreeSort not given its own Settings
 		static const Settings& get();
+		
+		// Defaults with the tuning profile's entry for [count] elements of [T] applied
+		template<typename T> static Settings Tuned(size_t count);
 	};
 	
 	// ------------------------------------------------------------------------------
-
+	
 	template<typename Iter, typename Comparator>
 	class BTreeSort {
 	public:
@@ -112,112 +342,386 @@ namespace btreesort {
 			size_t size() const { return count; }
 			IterVal get(size_t i) const { return *(range[0] + i); }
 		};
-		class Slice : public SliceBase {
-		public:
-			IterVal median;
-			
-			Slice() : SliceBase() {}
-			Slice(size_t id, IterPair range) : SliceBase(id, range)
-			{
-				median = this->get(this->size() / 2);
-			}
-			
-			//bool operator<(const Slice& o) const { return median < o.median; }
-			//bool operator==(const Slice& o) const { return median == o.median; }
-			bool operator<(const Slice& o) const
-			{
-				if (median != o.median)
-					return Comparator()(median, o.median);
-				return this->id < o.id;
-			}
-			bool operator==(const Slice& o) const
-			{
-				if (median != o.median)
-					return false;
-				return this->id == o.id;
-			}
-		};
+		// Merge cursor, the head key is kept by value next to the read position 
+		//    so comparisons don't go back to the slice or the data
 		class SliceValue {
 		public:
-			const SliceBase* pSlice;
-			size_t iRead;
+			IterVal key;
+			Iter itrRead;
+			Iter itrEnd;
 			
 			SliceValue() = default;
-			SliceValue(const SliceBase* pSlice) : pSlice(pSlice), iRead(0) {}
+			SliceValue(const SliceBase& s) : 
+				key(*s.range[0]), itrRead(s.range[0]), itrEnd(s.range[1]) {}
 			
-			IterVal get() const { return pSlice->get(iRead); }
+			const IterVal& get() const { return key; }
 			
-			bool operator<(const SliceValue& o) const { return Comparator()(get(), o.get()); }
-			bool operator==(const SliceValue& o) const { return get() == o.get(); }
+			// Moves [n] elements ahead, false if the slice ran out
+			bool Advance(size_t n = 1)
+			{
+				itrRead += n;
+				if (itrRead == itrEnd) return false;
+				key = *itrRead;
+				return true;
+			}
+			
+			bool operator<(const SliceValue& o) const { return Comparator()(key, o.key); }
+			bool operator==(const SliceValue& o) const { return key == o.key; }
 		};
 	private:
 		IterPair data;
 		
-		set_t<Slice> setSlices;
+		// Copied per instance, sorts never touch the global OpenMP thread count
+		Settings settings;
+		
+		// Not given explicit Settings, so they're picked from the tuning profile per Sort() call
+		bool bTuned;
+		
+		// Merge work of one splitter group
+		struct _MergeGroup {
+			// The runs clipped to the group, then split into parts merged by separate tasks
+			std::vector<SliceBase> slices;
+			std::vector<std::pair<size_t, std::vector<SliceBase>>> parts;
+			size_t nParts = 0;
+			
+			// Output offset and element count of the whole group
+			size_t placement = 0;
+			size_t count = 0;
+		};
+		
+		// Everything below is working memory kept across Sort() calls, so a sorter reused 
+		//    on ranges of similar size stops allocating after the first few calls
+		
+		// Set-aside elements of nearly sorted buckets, one list per bucket
+		std::vector<std::vector<IterVal>> bucketStrays;
+		
+		std::vector<_MergeGroup> mergeGroups;
+		std::vector<std::pair<size_t, size_t>> mergeTasks;
+		
+		// Merge output of in-place sorts, either supplied by the caller or owned and kept 
+		//    across Sort() calls
+		IterVal* pScratch = nullptr;
+		Buffer<IterVal> scratchOwned;
+		
+		// One per merge task, reset and reused by every Sort() call
+		std::vector<Arena> mergeArenas;
+		size_t nMergeAllocs = 0;
+		
+		// Sorts the 32-bit offsets of narrowed 64-bit keys, created on first use
+		std::unique_ptr<BTreeSort<uint32_t*, std::less<uint32_t>>> pNarrowSorter;
 	public:
+		// No range yet, for a long-lived sorter given one range after another 
+		//    through Sort(begin, end)
+		BTreeSort();
+		explicit BTreeSort(const Settings& settings);
+		
 		BTreeSort(Iter begin, Iter end);
 		BTreeSort(Iter begin, Iter end, Comparator comp);
+		BTreeSort(Iter begin, Iter end, const Settings& settings);
+		BTreeSort(Iter begin, Iter end, Comparator comp, const Settings& settings);
 		virtual ~BTreeSort();
 		
-		void Sort();
+		// Applies to every following Sort() call
+		void SetSettings(const Settings& settings);
+		const Settings& GetSettings() const { return settings; }
+		
+		// [pBuffer] must hold at least as many elements as any range sorted with it 
+		//    and outlive the sorts
+		void SetScratchBuffer(IterVal* pBuffer);
+		
+		// Points the sorter at another range, the working memory of earlier sorts is kept
+		void Reset(Iter begin, Iter end);
+		
+		// Sorts the range in place
+		void Sort(SortEngine engine = SortEngine::Comparison);
+		
+		// Reset(), then Sort()
+		void Sort(Iter begin, Iter end, SortEngine engine = SortEngine::Comparison);
+		
+		// Writes the sorted range to [pDest], which must not overlap it, 
+		//    the range itself is used as working memory and is left unordered
+		void SortInto(IterVal* pDest, SortEngine engine = SortEngine::Comparison);
+		
+		// Chunks the merge heaps took from the system allocator during the last Sort() call,
+		//    zero once the arenas have grown to fit
+		size_t GetMergeAllocs() const { return nMergeAllocs; }
 	private:
+		Executor& _GetExecutor() const
+		{
+			return settings.pExecutor ? *settings.pExecutor : Executor::Default();
+		}
+		
+		// Node the memory of every task is on, and the order to hand the tasks out in 
+		//    so threads spread over all nodes
+		// Every task is on no node and handed out in order unless the sort is NUMA-aware
+		struct _Placement {
+			std::vector<int> nodes;
+			std::vector<size_t> order;
+		};
+		template<typename F> _Placement _PlaceTasks(size_t n, F fnAddress) const
+		{
+			_Placement res { std::vector<int>(n, -1), {} };
+			if (settings.bNumaAware) {
+				for (size_t i = 0; i < n; ++i)
+					res.nodes[i] = bs_NodeOfAddress(fnAddress(i));
+			}
+			res.order = bs_InterleaveByNode(res.nodes);
+			return res;
+		}
+		
+		void _Sort(IterVal* pDest, SortEngine engine);
+		void _SortNarrowed(IterVal lo, IterVal* pDest, SortEngine engine);
+		IterVal* _GetScratch(size_t count);
+		
 		std::vector<std::array<size_t, 3>> _GenerateDivisions(size_t count, size_t divs);
+		std::vector<std::vector<size_t>> _SelectSplitters(
+			const std::vector<std::array<size_t, 3>>& buckets, size_t nGroups);
 		
-		void _SortBucket(size_t id, IterPair range);
-		void _ShuffleSlices(Iter dest, const std::vector<const Slice*>& slices);
-		void _MultiwayHeap(Iter dest, const std::vector<SliceBase>& slices);
+		bool _ScanOrder(const std::vector<std::array<size_t, 3>>& buckets, 
+			std::vector<bs_Order>& orders, IterVal* pDest);
+		size_t _SortBucket(size_t id, IterPair range, const bs_Order& order);
+		void _ShuffleSlices(IterVal* dest, const std::vector<std::vector<size_t>>& splitters);
+		size_t _SplitGroup(const std::vector<SliceBase>& slices, size_t count, size_t nPerPart, 
+			std::vector<std::pair<size_t, std::vector<SliceBase>>>& res);
+		void _MultiwayHeap(IterVal* dest, const std::vector<SliceBase>& slices, Arena& arena);
 	};
-
+	
 	// ------------------------------------------------------------------------------
 
 #define TEMPL template<typename Iter, typename Comparator>
 #define DEF_BTreeSort BTreeSort<Iter, Comparator>::
-
+	
+	TEMPL inline DEF_BTreeSort
+	BTreeSort() : 
+		data({}), settings(Settings::get()), bTuned(true) {}
+	TEMPL inline DEF_BTreeSort
+	BTreeSort(const Settings& settings) : 
+		data({}), settings(settings), bTuned(false) {}
 	TEMPL inline DEF_BTreeSort 
 	BTreeSort(Iter begin, Iter end) : 
-		data({ begin, end }) 
-	{
-		omp_set_dynamic(false);
-		omp_set_num_threads(Settings::get().nProcessors);
-	}
+		data({ begin, end }), settings(Settings::get()), bTuned(true) {}
+	// The comparator only names [Comparator] for deduction, BTreeSort default-constructs its own
 	TEMPL inline DEF_BTreeSort
-	BTreeSort(Iter begin, Iter end, Comparator comp) :
+	BTreeSort(Iter begin, Iter end, Comparator) :
 		BTreeSort(begin, end) {}
+	TEMPL inline DEF_BTreeSort 
+	BTreeSort(Iter begin, Iter end, const Settings& settings) : 
+		data({ begin, end }), settings(settings), bTuned(false) {}
+	TEMPL inline DEF_BTreeSort
+	BTreeSort(Iter begin, Iter end, Comparator, const Settings& settings) :
+		BTreeSort(begin, end, settings) {}
 	TEMPL inline DEF_BTreeSort ~BTreeSort() {}
 	
-	TEMPL void DEF_BTreeSort Sort()
+	TEMPL void DEF_BTreeSort SetSettings(const Settings& settings)
+	{
+		this->settings = settings;
+		bTuned = false;
+	}
+	
+	TEMPL void DEF_BTreeSort SetScratchBuffer(IterVal* pBuffer)
+	{
+		pScratch = pBuffer;
+		scratchOwned = {};
+	}
+	
+	TEMPL void DEF_BTreeSort Reset(Iter begin, Iter end)
+	{
+		data = { begin, end };
+	}
+	
+	TEMPL void DEF_BTreeSort Sort(SortEngine engine)
+	{
+		_Sort(nullptr, engine);
+	}
+	TEMPL void DEF_BTreeSort Sort(Iter begin, Iter end, SortEngine engine)
+	{
+		Reset(begin, end);
+		_Sort(nullptr, engine);
+	}
+	TEMPL void DEF_BTreeSort SortInto(IterVal* pDest, SortEngine engine)
+	{
+		_Sort(pDest, engine);
+	}
+	
+	// Sorts into [pDest], or in place through the scratch buffer if it's null
+	TEMPL void DEF_BTreeSort _Sort(IterVal* pDest, SortEngine engine)
 	{
-		size_t nProcessors = Settings::get().nProcessors;
-		//size_t nSlices = Settings::get().nSubBuckets;
-		
 		auto& [itrBegin, itrEnd] = data;
 		size_t dataCount = std::distance(itrBegin, itrEnd);
 		
+		if (bTuned)
+			settings = Settings::Tuned<IterVal>(dataCount);
+		
+		nMergeAllocs = 0;
+		
+		size_t nProcessors = settings.nProcessors;
+		//size_t nSlices = settings.nSubBuckets;
+		
 		// If too few data, just use normal sorting
-		if (dataCount < Settings::get().nParallelCutoff) {
+		// Below two elements there are no buckets to scan or merge, whatever the cutoff
+		if (dataCount < std::max<size_t>(settings.nParallelCutoff, 2)) {
 			std::sort(itrBegin, itrEnd, Comparator());
+			if (pDest)
+				std::copy(itrBegin, itrEnd, pDest);
+			return;
 		}
-		else {
-			auto buckets = _GenerateDivisions(dataCount, nProcessors);
+		
+		// Over-decomposed buckets, but never fewer elements per slice than the cutoff allows
+		size_t nBuckets = nProcessors * std::max<size_t>(settings.nBucketsPerThread, 1);
+		nBuckets = std::min(nBuckets, std::max(nProcessors, 
+			dataCount / std::max<size_t>(settings.nSubBuckets * settings.nMinPerSlice, 1)));
+		
+		auto buckets = _GenerateDivisions(dataCount, nBuckets);
+		
+		// Without a scan every bucket counts as unordered
+		std::vector<bs_Order> orders(buckets.size(), bs_Order::Unordered());
+		if (settings.bDetectPresorted && _ScanOrder(buckets, orders, pDest))
+			return;
+		
+		if constexpr (bs_HasCountingSort<Iter, Comparator>) {
+			// Keys of a narrow range are counted instead of compared, whatever the engine
+			// Only while the histograms of all threads stay well below the data
+			using UType = std::make_unsigned_t<IterVal>;
 			
-#pragma omp parallel for
-			for (auto& [i, begin, end] : buckets) {
-				_SortBucket(i, { itrBegin + begin, itrBegin + end });
+			auto [lo, hi] = bs_MinMax(itrBegin, itrEnd, nProcessors, _GetExecutor());
+			size_t diff = (size_t)(UType)((UType)hi - (UType)lo);
+			
+			if (diff < BS_COUNTING_RANGE && (diff + 1) * nProcessors <= dataCount) {
+				bs_CountingSort(itrBegin, itrEnd, lo, diff + 1, nProcessors, pDest, _GetExecutor());
+				return;
 			}
 			
-			{
-				std::vector<const Slice*> slicesSorted;
-				slicesSorted.reserve(setSlices.size());
-				
-				for (const Slice& s : setSlices) {
-					slicesSorted.push_back(&s);
+			if constexpr (bs_HasNarrowing<Iter, Comparator>) {
+				if (settings.bNarrowKeys && diff <= UINT32_MAX) {
+					_SortNarrowed(lo, pDest, engine);
+					return;
 				}
+			}
+		}
+		
+		// Merges and radix passes read the range and write here, never back into the range
+		IterVal* pOut = pDest ? pDest : _GetScratch(dataCount);
+		
+		if constexpr (bs_HasRadixSort<Iter, Comparator>) {
+			if (engine == SortEngine::Radix) {
+				// Radix partitions are ordered by key, so no slices or merging are needed
+				bs_RadixSort(itrBegin, itrEnd, nProcessors, pOut, pDest != nullptr, _GetExecutor());
+				return;
+			}
+		}
+		
+		{
+			if (bucketStrays.size() < buckets.size())
+				bucketStrays.resize(buckets.size());
+			
+			// Threads pull buckets off a shared counter, so one slowed down by other load 
+			//    just sorts fewer of them
+			// Once out of buckets, a thread picks up the quicksort subranges 
+			//    other buckets left as tasks
+			std::vector<size_t> splits(buckets.size());
+			
+			auto placement = _PlaceTasks(buckets.size(), [&](size_t i) { 
+				return &*(itrBegin + buckets[i][1]); 
+			});
+			_GetExecutor().ParallelFor(buckets.size(), nProcessors, [&](size_t i) {
+				size_t iBucket = placement.order[i];
+				NodeBinding bind(placement.nodes[iBucket]);
 				
-				_ShuffleSlices(itrBegin, slicesSorted);
-				bs_InsertionSort(itrBegin, itrEnd, Comparator());
+				auto& [id, begin, end] = buckets[iBucket];
+				splits[iBucket] = begin + _SortBucket(id, { itrBegin + begin, itrBegin + end }, 
+					orders[iBucket]);
+			});
+			
+			// Nearly sorted buckets come out as two runs, the merge works on runs
+			std::vector<std::array<size_t, 3>> runs;
+			runs.reserve(buckets.size() * 2);
+			for (size_t i = 0; i < buckets.size(); ++i) {
+				auto& [_, begin, end] = buckets[i];
+				if (splits[i] > begin)
+					runs.push_back({ runs.size(), begin, splits[i] });
+				if (splits[i] < end)
+					runs.push_back({ runs.size(), splits[i], end });
+			}
+			
+			{
+				// Groups own disjoint key ranges, so no fix-up pass is needed after merging
+				auto splitters = _SelectSplitters(runs, 
+					std::max<size_t>(settings.nMergeGroups, 1));
+				_ShuffleSlices(pOut, splitters);
+			}
+			
+			if (pDest == nullptr) {
+				auto divs = _GenerateDivisions(dataCount, nProcessors);
+				auto placement = _PlaceTasks(divs.size(), [&](size_t i) { 
+					return &*(itrBegin + divs[i][1]); 
+				});
+				
+				_GetExecutor().ParallelFor(divs.size(), nProcessors, [&](size_t i) {
+					size_t iDiv = placement.order[i];
+					NodeBinding bind(placement.nodes[iDiv]);
+					
+					auto& [_, begin, end] = divs[iDiv];
+					std::copy(pOut + begin, pOut + end, itrBegin + begin);
+				});
 			}
 		}
 	}
+	// Sorts the keys as 32-bit offsets from [lo], which every key must be within,
+	//    so every pass of the sort moves half the bytes
+	// The offsets and the narrow sort's own scratch share the scratch buffer, one half each
+	TEMPL void DEF_BTreeSort _SortNarrowed(IterVal lo, IterVal* pDest, SortEngine engine)
+	{
+		using UType = std::make_unsigned_t<IterVal>;
+		
+		auto& [itrBegin, itrEnd] = data;
+		size_t dataCount = std::distance(itrBegin, itrEnd);
+		size_t nProcessors = settings.nProcessors;
+		
+		uint32_t* pKeys = (uint32_t*)_GetScratch(dataCount);
+		auto divs = _GenerateDivisions(dataCount, nProcessors);
+		
+		_GetExecutor().ParallelFor(divs.size(), nProcessors, [&](size_t i) {
+			auto& [_, begin, end] = divs[i];
+			Iter itr = itrBegin + begin;
+			for (size_t j = begin; j < end; ++j, ++itr)
+				pKeys[j] = (uint32_t)((UType)*itr - (UType)lo);
+		});
+		
+		if (!pNarrowSorter)
+			pNarrowSorter.reset(new BTreeSort<uint32_t*, std::less<uint32_t>>());
+		
+		auto& sorter = *pNarrowSorter;
+		sorter.SetSettings(bTuned ? Settings::Tuned<uint32_t>(dataCount) : settings);
+		sorter.SetScratchBuffer(pKeys + dataCount);
+		sorter.Sort(pKeys, pKeys + dataCount, engine);
+		nMergeAllocs = sorter.GetMergeAllocs();
+		
+		_GetExecutor().ParallelFor(divs.size(), nProcessors, [&](size_t i) {
+			auto& [_, begin, end] = divs[i];
+			if (pDest) {
+				for (size_t j = begin; j < end; ++j)
+					pDest[j] = (IterVal)((UType)lo + pKeys[j]);
+			}
+			else {
+				Iter itr = itrBegin + begin;
+				for (size_t j = begin; j < end; ++j, ++itr)
+					*itr = (IterVal)((UType)lo + pKeys[j]);
+			}
+		});
+	}
+	TEMPL typename DEF_BTreeSort IterVal* DEF_BTreeSort _GetScratch(size_t count)
+	{
+		if (pScratch)
+			return pScratch;
+		
+		if (scratchOwned.size() < count) {
+			// A fresh buffer, so the old contents aren't copied and the pages can be placed
+			scratchOwned = Buffer<IterVal>(count);
+			if (settings.bNumaAware)
+				bs_FirstTouch(scratchOwned.data(), count, settings.nProcessors, _GetExecutor());
+		}
+		return scratchOwned.data();
+	}
 	
 	// Divides [count] elements into [divs] divisions roughly equally
 	TEMPL std::vector<std::array<size_t, 3>> DEF_BTreeSort 
@@ -234,138 +738,334 @@ namespace btreesort {
 		return res;
 	}
 	
-	TEMPL void DEF_BTreeSort _SortBucket(size_t id, IterPair bucket)
+	// Computes exact rank splitters over the sorted buckets
+	// Group [i] owns [res[i][j], res[i + 1][j]) of every bucket [j], as offsets from the data begin
+	TEMPL std::vector<std::vector<size_t>> DEF_BTreeSort
+	_SelectSplitters(const std::vector<std::array<size_t, 3>>& buckets, size_t nGroups)
 	{
-		auto& [itrBegin, itrEnd] = bucket;
-		size_t count = std::distance(itrBegin, itrEnd);
+		auto& [itrBegin, itrEnd] = data;
+		size_t dataCount = std::distance(itrBegin, itrEnd);
 		
-		size_t heapSize = Settings::get().nMaxHeapSize;
-		bs_QuickSort<false>(itrBegin, itrEnd, Comparator(), heapSize);
+		std::vector<IterPair> runs;
+		runs.reserve(buckets.size());
+		for (auto& [i, begin, end] : buckets) {
+			runs.push_back({ itrBegin + begin, itrBegin + end });
+		}
 		
-		size_t nSlices = count / heapSize;
-		if (nSlices < Settings::get().nSubBuckets)
-			nSlices = Settings::get().nSubBuckets;
+		std::vector<std::vector<size_t>> res(nGroups + 1);
+		auto ranks = _GenerateDivisions(dataCount, nGroups);
 		
-		auto partitions = _GenerateDivisions(std::distance(itrBegin, itrEnd), nSlices);
+		_GetExecutor().ParallelFor(ranks.size(), settings.nProcessors, [&](size_t i) {
+			auto pos = bs_MultiSequenceSelect(runs, ranks[i][1], Comparator());
+			for (size_t j = 0; j < buckets.size(); ++j) {
+				pos[j] += buckets[j][1];
+			}
+			res[i] = std::move(pos);
+		});
 		
-#pragma omp critical
-		{
-			// Partition slices
+		res[nGroups].reserve(buckets.size());
+		for (auto& [i, begin, end] : buckets) {
+			res[nGroups].push_back(end);
+		}
+		
+		return res;
+	}
+	
+	// Measures the order of every bucket in [orders], and if the whole range turns out 
+	//    sorted or reversed, finishes the sort here in one pass
+	// Returns whether the sort is done
+	TEMPL bool DEF_BTreeSort _ScanOrder(const std::vector<std::array<size_t, 3>>& buckets, 
+		std::vector<bs_Order>& orders, IterVal* pDest)
+	{
+		auto& [itrBegin, itrEnd] = data;
+		size_t dataCount = std::distance(itrBegin, itrEnd);
+		size_t nProcessors = settings.nProcessors;
+		
+		_GetExecutor().ParallelFor(buckets.size(), nProcessors, [&](size_t i) {
+			auto& [_, begin, end] = buckets[i];
+			orders[i] = bs_ScanOrder(itrBegin + begin, itrBegin + end, Comparator(), 
+				(end - begin) / BS_PRESORTED_DESCENTS);
+		});
+		
+		// The buckets also have to meet in order
+		bool bSorted = true, bReversed = true;
+		for (size_t i = 0; i < buckets.size(); ++i) {
+			bSorted = bSorted && orders[i].IsSorted();
+			bReversed = bReversed && orders[i].IsReversed();
 			
-			for (auto& [i, begin, end] : partitions) {
-				Slice s(setSlices.size(), { itrBegin + begin, itrBegin + end });
-				setSlices.insert(std::move(s));
+			// Empty buckets have no first element, the one before is still the previous last
+			auto& [_, begin, end] = buckets[i];
+			if (begin > 0 && begin < end) {
+				auto& last = *(itrBegin + (begin - 1));
+				auto& first = *(itrBegin + begin);
+				bSorted = bSorted && !Comparator()(first, last);
+				bReversed = bReversed && !Comparator()(last, first);
+			}
+		}
+		if (!bSorted && !bReversed)
+			return false;
+		
+		auto divs = _GenerateDivisions(bSorted || pDest ? dataCount : dataCount / 2, nProcessors);
+		
+		_GetExecutor().ParallelFor(divs.size(), nProcessors, [&](size_t i) {
+			auto& [_, begin, end] = divs[i];
+			if (bSorted) {
+				if (pDest)
+					std::copy(itrBegin + begin, itrBegin + end, pDest + begin);
+			}
+			else if (pDest) {
+				std::reverse_copy(itrEnd - end, itrEnd - begin, pDest + begin);
+			}
+			else {
+				// Every thread swaps its part of the front half with the mirrored part of the back
+				std::swap_ranges(itrBegin + begin, itrBegin + end, 
+					std::make_reverse_iterator(itrEnd - begin));
 			}
+		});
+		
+		return true;
+	}
+	
+	// Sorts the bucket, returns where the second of its sorted runs begins,
+	//    which is the bucket's size if it's all one run
+	TEMPL size_t DEF_BTreeSort _SortBucket(size_t id, IterPair bucket, const bs_Order& order)
+	{
+		auto& [itrBegin, itrEnd] = bucket;
+		size_t count = std::distance(itrBegin, itrEnd);
+		
+		size_t cutoff = bs_HasNetworkSort<Iter, Comparator> ?
+			settings.nNetworkSortCutoff : settings.nQuickSortCutoff;
+		
+		if (order.IsSorted())
+			return count;
+		if (order.IsReversed()) {
+			std::reverse(itrBegin, itrEnd);
+			return count;
 		}
+		if (!order.IsUnordered() && order.nDescents <= count / BS_PRESORTED_DESCENTS) {
+			auto [itrSplit, bSplit] = bs_SplitStrays(itrBegin, itrEnd, Comparator(), cutoff, 
+				count / BS_PRESORTED_STRAYS, bucketStrays[id]);
+			if (bSplit)
+				return std::distance(itrBegin, itrSplit);
+		}
+		
+		// Slicing needs the whole bucket sorted, including the parts stolen by other threads
+		_GetExecutor().TaskGroup([&](Executor::Spawner& spawner) {
+			bs_QuickSort(itrBegin, itrEnd, Comparator(), cutoff, settings.nTaskGrain, &spawner);
+		});
+		return count;
 	}
-	TEMPL void DEF_BTreeSort _ShuffleSlices(Iter dest, 
-		const std::vector<const Slice*>& slicesSorted)
+	// Merges the runs group by group into [dest]
+	// Every run's part in a group is one sorted piece, so a group merges at most one piece per run
+	TEMPL void DEF_BTreeSort _ShuffleSlices(IterVal* dest, 
+		const std::vector<std::vector<size_t>>& splitters)
 	{
-		size_t nProcessors = Settings::get().nProcessors;
+		size_t nGroups = splitters.size() - 1;
+		size_t nRuns = splitters[0].size();
+		
+		// Groups beyond [nGroups] are left as they are, so their vectors keep their capacity
+		if (mergeGroups.size() < nGroups)
+			mergeGroups.resize(nGroups);
+		
+		// No thread should merge much more than its even share of the data
+		size_t nPerPart = 0;
 		
 		{
-			struct _ShufParam {
-				size_t index;
+			size_t placement = 0;
+			for (size_t i = 0; i < nGroups; ++i) {
+				// Sum the amount of data this group owns across all runs
+				size_t count = 0;
+				for (size_t j = 0; j < nRuns; ++j) {
+					count += splitters[i + 1][j] - splitters[i][j];
+				}
 				
-				std::vector<IterVal> tmp;
-				std::vector<SliceBase> newSlices;
+				_MergeGroup& group = mergeGroups[i];
+				group.slices.clear();
+				group.placement = placement;
+				group.count = count;
 				
-				std::array<size_t, 2> srcRange;
-
-				size_t placement;
-				size_t count;
-			};
-			std::vector<_ShufParam> shufParams(nProcessors);
-			
-			auto sliceDivs = _GenerateDivisions(slicesSorted.size(), shufParams.size());
+				placement += count;
+			}
 			
-			{
-				size_t placement = 0;
-				for (auto& [i, iBegin, iEnd] : sliceDivs) {
-					auto itrSliceBeg = slicesSorted.begin() + iBegin;
-					auto itrSliceEnd = slicesSorted.begin() + iEnd;
-					
-					// Sum the amount of all data in this slice range
-					size_t count = 0;
-					for (auto itr = itrSliceBeg; itr != itrSliceEnd; ++itr) {
-						count += (*itr)->size();
-					}
-					
-					_ShufParam sp {};
-					sp.index = i;
-					sp.srcRange = { iBegin, iEnd };
-					sp.placement = placement;
-					sp.count = count;
-					
-					shufParams[i] = std::move(sp);
-					placement += count;
-				}
+			size_t nProcessors = settings.nProcessors;
+			nPerPart = std::max<size_t>((placement + nProcessors - 1) / nProcessors, 1);
+		}
+		
+		// Groups read their parts of the runs in place and only write to their own part 
+		//    of [dest], so no group waits for another
+		_GetExecutor().ParallelFor(nGroups, settings.nProcessors, [&](size_t i) {
+			_MergeGroup& group = mergeGroups[i];
+			for (size_t j = 0; j < nRuns; ++j) {
+				size_t begin = splitters[i][j];
+				size_t end = splitters[i + 1][j];
+				if (begin < end)
+					group.slices.push_back(SliceBase(j, { data[0] + begin, data[0] + end }));
 			}
-
-//#pragma omp parallel
-			{
-#pragma omp parallel for
-				for (_ShufParam& sp : shufParams) {
-					sp.tmp.reserve(sp.count);
-					
-					for (auto i = sp.srcRange[0]; i != sp.srcRange[1]; ++i) {
-						const Slice* s = slicesSorted[i];
-						
-						// Copy data from original slice into temp array
-						auto before = sp.tmp.insert(sp.tmp.end(), 
-							s->range[0], s->range[1]);
-						
-						// Copy slice info, but change the range
-						SliceBase ns(s->id, { before, sp.tmp.end() });
-						sp.newSlices.push_back(std::move(ns));
-					}
-				}
-
-//#pragma omp barrier
-
-#pragma omp parallel for
-				for (const _ShufParam& sp : shufParams) {
-					_MultiwayHeap(dest + sp.placement, sp.newSlices);
-					//std::copy(sp.tmp.begin(), sp.tmp.end(), dest + sp.placement);
+			
+			group.nParts = _SplitGroup(group.slices, group.count, nPerPart, group.parts);
+		});
+		
+		// Every part of a group covers its own output range, found by co-ranking 
+		//    the group's slices, so a large group is merged by several threads
+		auto& tasks = mergeTasks;
+		tasks.clear();
+		for (size_t i = 0; i < nGroups; ++i) {
+			for (size_t j = 0; j < mergeGroups[i].nParts; ++j)
+				tasks.push_back({ i, j });
+		}
+		
+		// A part is merged on the node its output is on, so all writes stay local
+		auto _Output = [&](size_t i) {
+			auto& [iGroup, iPart] = tasks[i];
+			return dest + mergeGroups[iGroup].placement + mergeGroups[iGroup].parts[iPart].first;
+		};
+		auto placement = _PlaceTasks(tasks.size(), _Output);
+		
+		// Merge heaps never go to the shared allocator from inside the merge loop
+		if (mergeArenas.size() < tasks.size())
+			mergeArenas.resize(tasks.size());
+		
+		auto _CountAllocs = [&]() {
+			size_t res = 0;
+			for (auto& arena : mergeArenas)
+				res += arena.GetSystemAllocs();
+			return res;
+		};
+		size_t nAllocsBefore = _CountAllocs();
+		
+		_GetExecutor().ParallelFor(tasks.size(), settings.nProcessors, [&](size_t i) {
+			size_t iTask = placement.order[i];
+			NodeBinding bind(placement.nodes[iTask]);
+			
+			Arena& arena = mergeArenas[iTask];
+			arena.Reset();
+			
+			auto& [iGroup, iPart] = tasks[iTask];
+			_MultiwayHeap(_Output(iTask), mergeGroups[iGroup].parts[iPart].second, arena);
+		});
+		
+		nMergeAllocs = _CountAllocs() - nAllocsBefore;
+	}
+	
+	// Splits the merge of [slices] into parts of at most [nPerPart] output elements
+	// Fills the output offset and the sub-slices of every part into the front of [res], 
+	//    and returns how many parts there are
+	TEMPL size_t DEF_BTreeSort _SplitGroup(const std::vector<SliceBase>& slices, size_t count, 
+		size_t nPerPart, std::vector<std::pair<size_t, std::vector<SliceBase>>>& res)
+	{
+		size_t nParts = std::max<size_t>((count + nPerPart - 1) / nPerPart, 1);
+		if (res.size() < nParts)
+			res.resize(nParts);
+		
+		if (nParts == 1) {
+			res[0].first = 0;
+			res[0].second = slices;
+			return 1;
+		}
+		
+		std::vector<IterPair> runs;
+		runs.reserve(slices.size());
+		for (auto& s : slices) {
+			runs.push_back(s.range);
+		}
+		
+		auto divs = _GenerateDivisions(count, nParts);
+		
+		auto lo = bs_MultiSequenceSelect(runs, 0, Comparator());
+		for (auto& [i, begin, end] : divs) {
+			auto hi = bs_MultiSequenceSelect(runs, end, Comparator());
+			
+			auto& [offset, parts] = res[i];
+			offset = begin;
+			parts.clear();
+			for (size_t j = 0; j < slices.size(); ++j) {
+				if (lo[j] < hi[j]) {
+					Iter itrBegin = slices[j].range[0];
+					parts.push_back(SliceBase(slices[j].id, { itrBegin + lo[j], itrBegin + hi[j] }));
 				}
 			}
+			
+			lo = std::move(hi);
 		}
+		
+		return nParts;
 	}
-	TEMPL void DEF_BTreeSort _MultiwayHeap(Iter dest, const std::vector<SliceBase>& slices)
+	TEMPL void DEF_BTreeSort _MultiwayHeap(IterVal* dest, const std::vector<SliceBase>& slices, 
+		Arena& arena)
 	{
-		MultiwaySet<SliceValue, std::less<SliceValue>> heap;
+		ArenaAllocator<SliceValue> alloc(arena);
+		MultiwaySet<SliceValue, std::less<SliceValue>, ArenaAllocator<SliceValue>> heap(alloc);
 		
 		for (auto& s : slices) {
 			if (s.size() > 0) {
-				heap.Push(SliceValue(&s));
+				heap.Push(SliceValue(s));
 			}
 		}
-
+		
+		// Consecutive wins of the same slice
+		Iter itrLastEnd = data[1];
+		size_t nStreak = 0;
+		
 		while (!heap.Empty()) {
 			SliceValue front = std::move(heap.Peek());
 			
-			// Pop min element from heap into dest
-			*(dest++) = front.get();
-			heap.Pop();
+			if (front.itrEnd != itrLastEnd) {
+				itrLastEnd = front.itrEnd;
+				nStreak = 0;
+			}
+			
+			if (++nStreak < BS_MERGE_GALLOP) {
+				// Pop min element from heap into dest
+				*(dest++) = front.key;
+				heap.Pop();
+				
+				// Copies of the min key can't come after anything else left, 
+				//    so a run of them goes out whole and the slice is pushed back once
+				size_t count = 1;
+				Iter itrNext = front.itrRead + 1;
+				if (itrNext != front.itrEnd && !Comparator()(front.key, *itrNext)) {
+					Iter itrStop = bs_GallopUpperBound(itrNext, front.itrEnd, front.key, Comparator());
+					dest = std::copy(itrNext, itrStop, dest);
+					count += std::distance(itrNext, itrStop);
+				}
+				
+				// Advance the cursor and move the next element into the heap
+				if (front.Advance(count)) {
+					heap.Push(std::move(front));
+				}
+				continue;
+			}
 			
 			{
-				// Advance read index and move the next element into the heap
+				// Gallop, everything up to the runner-up's head goes out in one copy
+				//    and the last slice left goes out whole
+				const SliceValue* pSecond = heap.PeekSecond();
+				Iter itrStop = pSecond == nullptr ? front.itrEnd :
+					bs_GallopUpperBound(front.itrRead, front.itrEnd, pSecond->key, Comparator());
+				
+				size_t count = std::distance(front.itrRead, itrStop);
+				dest = std::copy(front.itrRead, itrStop, dest);
+				heap.Pop();
+				
+				// Short runs mean the slices interleave again
+				if (count < BS_MERGE_GALLOP)
+					nStreak = 0;
 				
-				front.iRead += 1;
-				if (front.iRead < front.pSlice->size()) {
+				if (front.Advance(count)) {
 					heap.Push(std::move(front));
 				}
 			}
 		}
 	}
-	
+
 #undef TEMPL
 	
 	// ------------------------------------------------------------------------------
 	
-	Settings::Settings()
+	inline Settings::Settings() : Settings(omp_get_num_procs()) {}
+	inline Settings::Settings(size_t nThreads)
 	{
-		nProcessors = omp_get_num_procs();
+		nProcessors = nThreads;
 		nSubBuckets = nProcessors;
 		
 		/* nProcessors = 4;
@@ -374,12 +1074,35 @@ namespace btreesort {
 		nMinPerSlice = 4;
 		nParallelCutoff = nProcessors * nSubBuckets * nMinPerSlice;
 		
-		nMaxHeapSize = 512;
-		nQuickSortCutoff = 1024;
+		nQuickSortCutoff = 24;
+		nNetworkSortCutoff = 128;
+		
+		nMergeGroups = nProcessors;
+		nTaskGrain = 1 << 14;
+		nBucketsPerThread = 1;
+		
+		pExecutor = nullptr;
+		bDetectPresorted = true;
+		bNarrowKeys = true;
+		bNumaAware = NumaTopology::get().IsNuma();
 	}
-	const Settings& Settings::get()
+	inline void Settings::Apply(const TuningEntry& entry)
+	{
+		nSubBuckets = entry.nSubBuckets;
+		nMinPerSlice = entry.nMinPerSlice;
+		nParallelCutoff = nProcessors * nSubBuckets * nMinPerSlice;
+	}
+	
+	inline const Settings& Settings::get()
 	{
 		static Settings s {};
 		return s;
 	}
+	template<typename T> Settings Settings::Tuned(size_t count)
+	{
+		Settings s = get();
+		if (auto pEntry = TuningProfile::get().Find(bs_TypeTag<T>, count))
+			s.Apply(*pEntry);
+		return s;
+	}
 }
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <array>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+#include "executor.hpp"
+
+// ------------------------------------------------------------------------------
+
+namespace btreesort {
+	// Largest number of distinct keys counting sort keeps a histogram for
+	constexpr size_t BS_COUNTING_RANGE = 1 << 16;
+	
+	// Integer keys under std::less, the value is the whole key, so the sorted range
+	//    can be written back from the histogram alone
+	template<typename Iter, typename Comparator,
+		typename ValType = typename std::iterator_traits<Iter>::value_type>
+	constexpr bool bs_HasCountingSort =
+		std::is_integral_v<ValType> && !std::is_same_v<ValType, bool> &&
+		(std::is_same_v<Comparator, std::less<ValType>> ||
+			std::is_same_v<Comparator, std::less<>>);
+	
+	// 64-bit integer keys under std::less, sorted as 32-bit offsets from the minimum 
+	//    when all of them lie less than 2^32 above it
+	template<typename Iter, typename Comparator,
+		typename ValType = typename std::iterator_traits<Iter>::value_type>
+	constexpr bool bs_HasNarrowing = bs_HasCountingSort<Iter, Comparator> && sizeof(ValType) == 8;
+	
+	// Smallest and largest value of [begin, end), which must not be empty
+	template<typename Iter, typename ValType = typename std::iterator_traits<Iter>::value_type>
+	std::array<ValType, 2> bs_MinMax(Iter begin, Iter end, size_t nThreads, Executor& exec)
+	{
+		size_t n = std::distance(begin, end);
+		nThreads = std::max<size_t>(std::min(nThreads, n), 1);
+		
+		std::vector<std::array<ValType, 2>> res(nThreads, { *begin, *begin });
+		exec.ParallelFor(nThreads, nThreads, [&](size_t t) {
+			// Kept in locals, so the compiler can vectorize the loop as a plain reduction
+			ValType lo = *begin, hi = *begin;
+			
+			Iter itr = begin + n * t / nThreads;
+			size_t count = n * (t + 1) / nThreads - n * t / nThreads;
+			for (size_t i = 0; i < count; ++i) {
+				lo = std::min(lo, itr[i]);
+				hi = std::max(hi, itr[i]);
+			}
+			
+			res[t] = { lo, hi };
+		});
+		
+		for (auto& [lo, hi] : res) {
+			res[0][0] = std::min(res[0][0], lo);
+			res[0][1] = std::max(res[0][1], hi);
+		}
+		return res[0];
+	}
+	
+	// Parallel counting sort of [begin, end), every value must lie in [lo, lo + range)
+	// Every thread counts its own chunk, then writes its share of the output straight
+	//    from the summed counts, so nothing is compared and no scratch copy is made
+	// The result goes to [pDest] if it's given, the range is then left as it was
+	template<typename Iter, typename ValType = typename std::iterator_traits<Iter>::value_type>
+	void bs_CountingSort(Iter begin, Iter end, ValType lo, size_t range, size_t nThreads,
+		ValType* pDest = nullptr, Executor& exec = Executor::Default())
+	{
+		// Offsets from [lo] in the unsigned type, so signed keys can't overflow
+		using UType = std::make_unsigned_t<ValType>;
+		
+		size_t n = std::distance(begin, end);
+		nThreads = std::max<size_t>(std::min(nThreads, n), 1);
+		
+		std::vector<std::vector<size_t>> counts(nThreads);
+		exec.ParallelFor(nThreads, nThreads, [&](size_t t) {
+			auto& count = counts[t];
+			count.assign(range, 0);
+			
+			for (Iter i = begin + n * t / nThreads; i != begin + n * (t + 1) / nThreads; ++i) {
+				++count[(UType)((UType)*i - (UType)lo)];
+			}
+		});
+		
+		// Summed across threads a slice of keys at a time
+		std::vector<size_t> starts(range + 1, 0);
+		exec.ParallelFor(nThreads, nThreads, [&](size_t t) {
+			for (size_t k = range * t / nThreads; k < range * (t + 1) / nThreads; ++k) {
+				size_t sum = 0;
+				for (auto& count : counts)
+					sum += count[k];
+				starts[k + 1] = sum;
+			}
+		});
+		for (size_t k = 0; k < range; ++k) {
+			starts[k + 1] += starts[k];
+		}
+		
+		exec.ParallelFor(nThreads, nThreads, [&](size_t t) {
+			size_t iBegin = n * t / nThreads;
+			size_t iEnd = n * (t + 1) / nThreads;
+			if (iBegin == iEnd) return;
+			
+			// Key of the first element this thread writes
+			size_t k = std::upper_bound(starts.begin(), starts.end(), iBegin) - starts.begin() - 1;
+			
+			for (size_t i = iBegin; i < iEnd; ++k) {
+				size_t stop = std::min(starts[k + 1], iEnd);
+				ValType val = (ValType)(UType)((UType)lo + (UType)k);
+				
+				if (pDest)
+					std::fill(pDest + i, pDest + stop, val);
+				else
+					std::fill(begin + i, begin + stop, val);
+				i = stop;
+			}
+		});
+	}
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+
+#include <omp.h>
+
+#if __has_include(<tbb/parallel_for.h>) && __has_include(<tbb/task_group.h>)
+	#include <tbb/parallel_for.h>
+	#include <tbb/task_group.h>
+	#include <tbb/task_arena.h>
+	#define BS_HAS_TBB
+#endif
+
+// ------------------------------------------------------------------------------
+
+// Executor used by sorts that aren't given one, OpenMP if neither is defined
+//#define USE_TBB_EXECUTOR
+//#define USE_POOL_EXECUTOR
+
+namespace btreesort {
+	// Runs the parallel loops and task groups of a sort
+	class Executor {
+	public:
+		// Queues tasks into one task group
+		class Spawner {
+		public:
+			virtual void Run(std::function<void()> fn) = 0;
+		};
+		
+		virtual ~Executor() = default;
+		
+		// Calls [fn] for every index in [0, n) on up to [nThreads] threads, in no particular order
+		virtual void ParallelFor(size_t n, size_t nThreads, const std::function<void(size_t)>& fn) = 0;
+		
+		// Calls [body], then returns once every task it queued, and every task those queued, is done
+		// Threads waiting here may run any queued task meanwhile
+		virtual void TaskGroup(const std::function<void(Spawner&)>& body) = 0;
+		
+		static Executor& Default();
+	};
+	
+	// ------------------------------------------------------------------------------
+	
+	class OpenMPExecutor : public Executor {
+		class _Spawner : public Spawner {
+		public:
+			void Run(std::function<void()> fn) override
+			{
+#pragma omp task firstprivate(fn)
+				fn();
+			}
+		};
+	public:
+		void ParallelFor(size_t n, size_t nThreads, const std::function<void(size_t)>& fn) override
+		{
+			nThreads = std::max<size_t>(std::min(nThreads, n), 1);
+			
+#pragma omp parallel for schedule(dynamic) num_threads(nThreads)
+			for (size_t i = 0; i < n; ++i) {
+				fn(i);
+			}
+		}
+		void TaskGroup(const std::function<void(Spawner&)>& body) override
+		{
+			// Tasks only go to other threads inside a parallel region, outside one they run inline
+			_Spawner spawner;
+#pragma omp taskgroup
+			body(spawner);
+		}
+	};
+
+#ifdef BS_HAS_TBB
+	// Loops run in a task arena of [nThreads] threads, one kept per thread count asked for
+	// Task groups run in the arena of whoever calls them, inside a loop that's the loop's
+	class TbbExecutor : public Executor {
+		std::vector<std::pair<size_t, std::unique_ptr<tbb::task_arena>>> arenas;
+		std::mutex mtxArenas;
+		
+		class _Spawner : public Spawner {
+			tbb::task_group& group;
+		public:
+			_Spawner(tbb::task_group& group) : group(group) {}
+			
+			void Run(std::function<void()> fn) override { group.run(std::move(fn)); }
+		};
+	public:
+		void ParallelFor(size_t n, size_t nThreads, const std::function<void(size_t)>& fn) override
+		{
+			_GetArena(nThreads).execute([&]() {
+				tbb::parallel_for((size_t)0, n, [&](size_t i) { fn(i); });
+			});
+		}
+		void TaskGroup(const std::function<void(Spawner&)>& body) override
+		{
+			tbb::task_group group;
+			_Spawner spawner(group);
+			
+			body(spawner);
+			group.wait();
+		}
+	private:
+		tbb::task_arena& _GetArena(size_t nThreads)
+		{
+			// More than the machine's threads would only make TBB warn and ignore the rest
+			nThreads = std::clamp<size_t>(nThreads, 1, tbb::this_task_arena::max_concurrency());
+			
+			std::lock_guard<std::mutex> lock(mtxArenas);
+			for (auto& [count, pArena] : arenas) {
+				if (count == nThreads)
+					return *pArena;
+			}
+			
+			arenas.push_back({ nThreads, std::make_unique<tbb::task_arena>((int)nThreads) });
+			return *arenas.back().second;
+		}
+	};
+#endif
+	
+	// Persistent threads fed from one shared queue, the calling thread takes part as well
+	// A thread waiting on a loop or task group runs queued work instead of blocking,
+	//    so nested loops and task groups can't deadlock the pool
+	class ThreadPoolExecutor : public Executor {
+		std::vector<std::thread> threads;
+		
+		std::deque<std::function<void()>> queue;
+		std::mutex mtxQueue;
+		std::condition_variable cvQueue;
+		bool bStop = false;
+		
+		class _Spawner : public Spawner {
+			ThreadPoolExecutor& pool;
+		public:
+			std::atomic<size_t> nPending { 0 };
+			
+			_Spawner(ThreadPoolExecutor& pool) : pool(pool) {}
+			
+			void Run(std::function<void()> fn) override
+			{
+				++nPending;
+				pool._Post([this, fn = std::move(fn)] {
+					fn();
+					--nPending;
+				});
+			}
+		};
+	public:
+		// [nThreads] counts the calling thread, so the pool starts one fewer
+		explicit ThreadPoolExecutor(size_t nThreads = std::thread::hardware_concurrency())
+		{
+			for (size_t i = 1; i < nThreads; ++i) {
+				threads.emplace_back([this] { _Worker(); });
+			}
+		}
+		~ThreadPoolExecutor()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mtxQueue);
+				bStop = true;
+			}
+			cvQueue.notify_all();
+			
+			for (auto& t : threads) {
+				t.join();
+			}
+		}
+		
+		void ParallelFor(size_t n, size_t nThreads, const std::function<void(size_t)>& fn) override
+		{
+			std::atomic<size_t> iNext { 0 };
+			std::atomic<size_t> nPending { 0 };
+			
+			auto _Loop = [&]() {
+				for (size_t i = iNext++; i < n; i = iNext++) {
+					fn(i);
+				}
+			};
+			
+			size_t nHelpers = std::min({ nThreads, threads.size() + 1, n });
+			for (size_t i = 1; i < nHelpers; ++i) {
+				++nPending;
+				_Post([&]() {
+					_Loop();
+					--nPending;
+				});
+			}
+			
+			_Loop();
+			_HelpUntilDone(nPending);
+		}
+		void TaskGroup(const std::function<void(Spawner&)>& body) override
+		{
+			_Spawner spawner(*this);
+			
+			body(spawner);
+			_HelpUntilDone(spawner.nPending);
+		}
+	private:
+		void _Post(std::function<void()> fn)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mtxQueue);
+				queue.push_back(std::move(fn));
+			}
+			cvQueue.notify_one();
+		}
+		bool _RunOne()
+		{
+			std::function<void()> fn;
+			{
+				std::lock_guard<std::mutex> lock(mtxQueue);
+				if (queue.empty()) return false;
+				
+				fn = std::move(queue.front());
+				queue.pop_front();
+			}
+			fn();
+			return true;
+		}
+		void _HelpUntilDone(const std::atomic<size_t>& nPending)
+		{
+			while (nPending > 0) {
+				if (!_RunOne())
+					std::this_thread::yield();
+			}
+		}
+		void _Worker()
+		{
+			while (true) {
+				std::function<void()> fn;
+				{
+					std::unique_lock<std::mutex> lock(mtxQueue);
+					cvQueue.wait(lock, [this] { return bStop || !queue.empty(); });
+					if (queue.empty()) return;
+					
+					fn = std::move(queue.front());
+					queue.pop_front();
+				}
+				fn();
+			}
+		}
+	};
+	
+	// ------------------------------------------------------------------------------
+	
+	inline Executor& Executor::Default()
+	{
+#if defined(USE_TBB_EXECUTOR) && defined(BS_HAS_TBB)
+		static TbbExecutor s;
+#elif defined(USE_POOL_EXECUTOR)
+		static ThreadPoolExecutor s;
+#else
+		static OpenMPExecutor s;
+#endif
+		return s;
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <limits>
+#include <iterator>
+#include <functional>
+#include <type_traits>
+
+#include "btree_sort.hpp"
+
+// ------------------------------------------------------------------------------
+
+namespace btreesort {
+	// Key and payload side by side in one record, so every phase of the sort moves
+	//    the payload in the same access as its key
+	template<typename Key, typename Value> struct KeyRecord {
+		Key key;
+		Value value;
+	};
+	
+	// Orders records by their keys alone
+	// BTreeSort default-constructs its comparators, so [Comparator] must be stateless
+	template<typename Key, typename Value, typename Comparator> struct KeyRecordLess {
+		static_assert(std::is_default_constructible_v<Comparator>, 
+			"Key comparators are default-constructed and can't carry state");
+		
+		bool operator()(const KeyRecord<Key, Value>& a, const KeyRecord<Key, Value>& b) const
+		{
+			return Comparator()(a.key, b.key);
+		}
+	};
+	
+	// Packs [n] records with fnPack(i) in parallel, sorts them with BTreeSort,
+	//    then hands every record and its sorted position to fnUnpack(i, record)
+	template<typename Record, typename RecordLess, typename FnPack, typename FnUnpack>
+	void bs_SortRecords(size_t n, const Settings& settings, FnPack fnPack, FnUnpack fnUnpack)
+	{
+		Executor& exec = settings.pExecutor ? *settings.pExecutor : Executor::Default();
+		size_t nThreads = std::max<size_t>(std::min(settings.nProcessors, n), 1);
+		
+		Buffer<Record> records(n);
+		exec.ParallelFor(nThreads, nThreads, [&](size_t t) {
+			for (size_t i = n * t / nThreads; i < n * (t + 1) / nThreads; ++i)
+				records[i] = fnPack(i);
+		});
+		
+		BTreeSort<typename Buffer<Record>::iterator, RecordLess> sorter(settings);
+		sorter.Sort(records.begin(), records.end());
+		
+		exec.ParallelFor(nThreads, nThreads, [&](size_t t) {
+			for (size_t i = n * t / nThreads; i < n * (t + 1) / nThreads; ++i)
+				fnUnpack(i, records[i]);
+		});
+	}
+	
+	// Sorts [keysBegin, keysEnd) and moves the values along with their keys,
+	//    [valuesBegin] must hold as many values as there are keys
+	// Values must be trivially copyable like the keys, the merge heap holds records by value
+	// Values of equal keys end up in no particular order
+	// The key order is given as a type, as in SortByKey<std::greater<>>(...)
+	template<typename Comparator = std::less<>, typename KeyIter, typename ValueIter>
+	void SortByKey(KeyIter keysBegin, KeyIter keysEnd, ValueIter valuesBegin,
+		const Settings& settings = Settings::get())
+	{
+		using Key = typename std::iterator_traits<KeyIter>::value_type;
+		using Value = typename std::iterator_traits<ValueIter>::value_type;
+		using Record = KeyRecord<Key, Value>;
+		
+		size_t n = std::distance(keysBegin, keysEnd);
+		
+		bs_SortRecords<Record, KeyRecordLess<Key, Value, Comparator>>(n, settings,
+			[&](size_t i) { return Record { keysBegin[i], valuesBegin[i] }; },
+			[&](size_t i, Record& r) {
+				keysBegin[i] = r.key;
+				valuesBegin[i] = r.value;
+			});
+	}
+	
+	// Permutation that sorts [begin, end), which is left as it is
+	// Element [i] of the result is the position of the [i]th smallest key,
+	//    so side columns are reordered by gathering through it
+	// Throws if [Index] can't hold every position
+	template<typename Index = uint32_t, typename Comparator = std::less<>, typename KeyIter>
+	std::vector<Index> Argsort(KeyIter begin, KeyIter end, 
+		const Settings& settings = Settings::get())
+	{
+		using Key = typename std::iterator_traits<KeyIter>::value_type;
+		using Record = KeyRecord<Key, Index>;
+		
+		size_t n = std::distance(begin, end);
+		if (n > 0 && n - 1 > (size_t)std::numeric_limits<Index>::max())
+			throw std::string("Too many keys for the argsort index type");
+		
+		std::vector<Index> res(n);
+		
+		bs_SortRecords<Record, KeyRecordLess<Key, Index, Comparator>>(n, settings,
+			[&](size_t i) { return Record { begin[i], (Index)i }; },
+			[&](size_t i, Record& r) { res[i] = r.value; });
+		
+		return res;
+	}
+}
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <new>
+#include <utility>
+#include <algorithm>
+
+#ifdef __linux__
+	#include <sys/mman.h>
+#endif
+
+// ------------------------------------------------------------------------------
+
+namespace btreesort {
+	// Page size asked for when backing large buffers with huge pages
+	constexpr size_t BS_HUGE_PAGE_SIZE = 2 << 20;
+	
+	// Allocations at least this large are mapped straight from the kernel
+	constexpr size_t BS_HUGE_PAGE_MIN = BS_HUGE_PAGE_SIZE;
+	
+	enum class HugePages {
+		Off,			// 4 KB pages only, even if transparent huge pages are always on
+		Transparent,	// madvise(MADV_HUGEPAGE), the kernel backs the mapping when it can
+		Reserved,		// MAP_HUGETLB from the reserved pool, Transparent if that's exhausted
+	};
+	
+	// Mode for every following large BufferAllocator allocation
+	inline HugePages& bs_HugePages()
+	{
+		static HugePages s = HugePages::Transparent;
+		return s;
+	}
+
+#ifdef __linux__
+	// Maps [size] bytes aligned to a huge page, [size] must be a multiple of one
+	inline void* bs_MapHugeAligned(size_t size, HugePages mode)
+	{
+		if (mode == HugePages::Reserved) {
+			int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+			// Ask for 2 MB pages even where the default huge page is 1 GB
+			flags |= 21 << MAP_HUGE_SHIFT;
+#endif
+			
+			void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+			if (p != MAP_FAILED)
+				return p;
+		}
+		
+		// Over-map by one huge page and trim both ends, so the kernel can use huge pages
+		//    from the very first byte
+		void* pMap = mmap(nullptr, size + BS_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pMap == MAP_FAILED)
+			throw std::bad_alloc();
+		
+		uintptr_t begin = (uintptr_t)pMap;
+		uintptr_t aligned = (begin + BS_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(BS_HUGE_PAGE_SIZE - 1);
+		
+		if (aligned > begin)
+			munmap(pMap, aligned - begin);
+		if (size_t tail = BS_HUGE_PAGE_SIZE - (aligned - begin))
+			munmap((void*)(aligned + size), tail);
+		
+		madvise((void*)aligned, size, mode == HugePages::Off ? MADV_NOHUGEPAGE : MADV_HUGEPAGE);
+		return (void*)aligned;
+	}
+#endif
+	
+	// std::allocator whose value-initializing construct default-initializes instead,
+	//    so resizing a buffer of trivial values doesn't write to it
+	// The pages are then first touched by whoever fills them, not by the thread that resized
+	// Large buffers are mapped on huge page boundaries and backed as bs_HugePages() says
+	template<typename T> class BufferAllocator : public std::allocator<T> {
+	public:
+		template<typename U> struct rebind { using other = BufferAllocator<U>; };
+		
+		BufferAllocator() = default;
+		template<typename U> BufferAllocator(const BufferAllocator<U>&) noexcept {}
+		
+		T* allocate(size_t n)
+		{
+#ifdef __linux__
+			if (n * sizeof(T) >= BS_HUGE_PAGE_MIN)
+				return (T*)bs_MapHugeAligned(_MappedSize(n), bs_HugePages());
+#endif
+			return std::allocator<T>::allocate(n);
+		}
+		void deallocate(T* p, size_t n)
+		{
+#ifdef __linux__
+			if (n * sizeof(T) >= BS_HUGE_PAGE_MIN) {
+				munmap(p, _MappedSize(n));
+				return;
+			}
+#endif
+			std::allocator<T>::deallocate(p, n);
+		}
+		
+		template<typename U> void construct(U* p) { ::new((void*)p) U; }
+		template<typename U, typename... Args> void construct(U* p, Args&&... args)
+		{
+			::new((void*)p) U(std::forward<Args>(args)...);
+		}
+	private:
+		static size_t _MappedSize(size_t n)
+		{
+			return (n * sizeof(T) + BS_HUGE_PAGE_SIZE - 1) & ~(BS_HUGE_PAGE_SIZE - 1);
+		}
+	};
+	
+	// Large buffers of keys, filled after they're sized
+	template<typename T> using Buffer = std::vector<T, BufferAllocator<T>>;
+	
+	// ------------------------------------------------------------------------------
+	
+	// Memory for the short-lived containers of one merge, handed out from large chunks
+	// Freed blocks go to a free list per size and are reused before the chunks are,
+	//    Reset() frees everything at once but keeps the chunks, so a merge no larger 
+	//    than the previous one doesn't go to the system allocator at all
+	// Not thread-safe, every thread needs its own
+	class Arena {
+		static constexpr size_t ALIGN = alignof(std::max_align_t);
+		static constexpr size_t CHUNK_MIN = 64 << 10;
+		
+		struct Chunk {
+			std::unique_ptr<char[]> p;
+			size_t size;
+		};
+		std::vector<Chunk> chunks;
+		
+		// Bump position, chunks before [iChunk] are full
+		size_t iChunk = 0;
+		size_t nUsed = 0;
+		
+		// Block size and head of every free list, each block links to the next 
+		//    through its first bytes
+		std::vector<std::pair<size_t, void*>> freeLists;
+		
+		size_t nSystemAllocs = 0;
+	public:
+		Arena() = default;
+		Arena(Arena&&) = default;
+		Arena& operator=(Arena&&) = default;
+		
+		void* Allocate(size_t size);
+		void Free(void* p, size_t size);
+		
+		// Every block handed out so far becomes invalid
+		void Reset();
+		
+		// Chunks taken from the system allocator since construction
+		size_t GetSystemAllocs() const { return nSystemAllocs; }
+	private:
+		static size_t _Round(size_t size) { return std::max((size + ALIGN - 1) & ~(ALIGN - 1), ALIGN); }
+	};
+	
+	// STL allocator drawing from an Arena, copies share it
+	template<typename T> class ArenaAllocator {
+		static_assert(alignof(T) <= alignof(std::max_align_t), 
+			"Arena blocks are only aligned for fundamental types");
+	public:
+		using value_type = T;
+		
+		Arena* pArena;
+		
+		explicit ArenaAllocator(Arena& arena) noexcept : pArena(&arena) {}
+		template<typename U> ArenaAllocator(const ArenaAllocator<U>& o) noexcept : pArena(o.pArena) {}
+		
+		T* allocate(size_t n) { return (T*)pArena->Allocate(n * sizeof(T)); }
+		void deallocate(T* p, size_t n) { pArena->Free(p, n * sizeof(T)); }
+		
+		template<typename U> bool operator==(const ArenaAllocator<U>& o) const { return pArena == o.pArena; }
+		template<typename U> bool operator!=(const ArenaAllocator<U>& o) const { return pArena != o.pArena; }
+	};
+	
+	inline void* Arena::Allocate(size_t size)
+	{
+		size = _Round(size);
+		
+		for (auto& [blockSize, pHead] : freeLists) {
+			if (blockSize == size && pHead != nullptr) {
+				void* p = pHead;
+				pHead = *(void**)p;
+				return p;
+			}
+		}
+		
+		while (iChunk < chunks.size() && nUsed + size > chunks[iChunk].size) {
+			++iChunk;
+			nUsed = 0;
+		}
+		if (iChunk == chunks.size()) {
+			// Doubling, so a growing merge settles on a few chunks
+			size_t chunkSize = chunks.empty() ? CHUNK_MIN : chunks.back().size * 2;
+			chunkSize = std::max(chunkSize, size);
+			
+			chunks.push_back({ std::unique_ptr<char[]>(new char[chunkSize]), chunkSize });
+			++nSystemAllocs;
+		}
+		
+		void* p = chunks[iChunk].p.get() + nUsed;
+		nUsed += size;
+		return p;
+	}
+	inline void Arena::Free(void* p, size_t size)
+	{
+		if (p == nullptr) return;
+		size = _Round(size);
+		
+		for (auto& [blockSize, pHead] : freeLists) {
+			if (blockSize == size) {
+				*(void**)p = pHead;
+				pHead = p;
+				return;
+			}
+		}
+		
+		*(void**)p = nullptr;
+		freeLists.push_back({ size, p });
+	}
+	inline void Arena::Reset()
+	{
+		iChunk = 0;
+		nUsed = 0;
+		
+		// Sizes stay listed, so the list itself doesn't grow again
+		for (auto& [blockSize, pHead] : freeLists)
+			pHead = nullptr;
+	}
+}
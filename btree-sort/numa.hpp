@@ -0,0 +1,219 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <algorithm>
+
+#ifdef __linux__
+	#include <sched.h>
+	#include <unistd.h>
+	#include <sys/syscall.h>
+#endif
+
+#include "executor.hpp"
+
+// ------------------------------------------------------------------------------
+
+namespace btreesort {
+	// Parses a sysfs list such as "0-3,8-11"
+	inline std::vector<size_t> bs_ParseCpuList(const std::string& list)
+	{
+		std::vector<size_t> res;
+		
+		std::istringstream ss(list);
+		std::string range;
+		while (std::getline(ss, range, ',')) {
+			size_t first = 0, last = 0;
+			char dash = 0;
+			
+			std::istringstream rs(range);
+			if (!(rs >> first)) continue;
+			last = (rs >> dash >> last && dash == '-') ? last : first;
+			
+			for (size_t i = first; i <= last; ++i)
+				res.push_back(i);
+		}
+		
+		return res;
+	}
+	
+	// NUMA nodes and their cpus, read from /sys/devices/system/node without libnuma
+	// Nodes are numbered densely here, [nodeIds] maps them back to the kernel's ids
+	// Without the sysfs tree there's one node holding every cpu
+	class NumaTopology {
+		std::vector<int> nodeIds;
+		std::vector<std::vector<size_t>> nodeCpus;
+	public:
+		NumaTopology();
+		
+		size_t NodeCount() const { return nodeCpus.size(); }
+		bool IsNuma() const { return nodeCpus.size() > 1; }
+		
+		const std::vector<size_t>& GetCpus(size_t node) const { return nodeCpus[node]; }
+		
+		// Dense index of the kernel's node [id], -1 if there's no such node
+		int IndexOf(int id) const;
+		
+		// Node holding chunk [i] of [n] equal chunks of a buffer,
+		//    so every node holds one contiguous block of it
+		size_t ChunkNode(size_t i, size_t n) const { return i * NodeCount() / std::max<size_t>(n, 1); }
+		
+		static const NumaTopology& get();
+	};
+	
+	// Pins the calling thread to the cpus of one node while in scope,
+	//    then puts back the affinity it had before
+	// A negative node, or a machine with one node, leaves the thread alone
+	class NodeBinding {
+#ifdef __linux__
+		cpu_set_t cpusOld;
+#endif
+		bool bBound = false;
+	public:
+		explicit NodeBinding(int node);
+		~NodeBinding();
+		
+		NodeBinding(const NodeBinding&) = delete;
+		NodeBinding& operator=(const NodeBinding&) = delete;
+	};
+	
+	// Node the page holding [p] lives on, -1 if it isn't placed yet or that can't be found out
+	inline int bs_NodeOfAddress(const void* p)
+	{
+#ifdef __linux__
+		const NumaTopology& topo = NumaTopology::get();
+		if (!topo.IsNuma()) return -1;
+		
+		// move_pages without target nodes only reports where the pages are
+		size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+		void* page = (void*)((uintptr_t)p & ~(uintptr_t)(pageSize - 1));
+		int status = -1;
+		
+		if (syscall(SYS_move_pages, 0, 1, &page, nullptr, &status, 0) != 0 || status < 0)
+			return -1;
+		return topo.IndexOf(status);
+#else
+		return -1;
+#endif
+	}
+	
+	// Order to hand out tasks in so consecutive ones go to different nodes,
+	//    threads pulling them off a shared counter then spread over all nodes
+	// Tasks on an unknown node (-1) are treated as one more node
+	inline std::vector<size_t> bs_InterleaveByNode(const std::vector<int>& nodes)
+	{
+		std::vector<size_t> rank(nodes.size());
+		{
+			std::vector<size_t> seen;
+			for (size_t i = 0; i < nodes.size(); ++i) {
+				size_t node = (size_t)(nodes[i] + 1);
+				if (node >= seen.size()) seen.resize(node + 1, 0);
+				rank[i] = seen[node]++;
+			}
+		}
+		
+		std::vector<size_t> res(nodes.size());
+		for (size_t i = 0; i < res.size(); ++i) res[i] = i;
+		
+		std::stable_sort(res.begin(), res.end(), [&](size_t a, size_t b) {
+			if (rank[a] != rank[b])
+				return rank[a] < rank[b];
+			return nodes[a] < nodes[b];
+		});
+		
+		return res;
+	}
+	
+	// Places [p, p + n) as one contiguous block per node, every page is first written
+	//    by a thread bound to the node it should end up on
+	// Only meant for memory that was never written, the values it touches are overwritten
+	template<typename T>
+	void bs_FirstTouch(T* p, size_t n, size_t nThreads, Executor& exec)
+	{
+		const NumaTopology& topo = NumaTopology::get();
+		if (!topo.IsNuma() || n == 0) return;
+		
+		constexpr size_t STRIDE = std::max<size_t>(4096 / sizeof(T), 1);
+		nThreads = std::max<size_t>(nThreads, topo.NodeCount());
+		
+		exec.ParallelFor(nThreads, nThreads, [&](size_t t) {
+			NodeBinding bind((int)topo.ChunkNode(t, nThreads));
+			
+			for (size_t i = n * t / nThreads; i < n * (t + 1) / nThreads; i += STRIDE) {
+				p[i] = T();
+			}
+		});
+	}
+	
+	// ------------------------------------------------------------------------------
+	
+	inline NumaTopology::NumaTopology()
+	{
+#ifdef __linux__
+		const std::string root = "/sys/devices/system/node/";
+		
+		std::ifstream online(root + "online");
+		std::string line;
+		if (online.is_open() && std::getline(online, line)) {
+			for (size_t id : bs_ParseCpuList(line)) {
+				std::ifstream file(root + "node" + std::to_string(id) + "/cpulist");
+				if (!file.is_open() || !std::getline(file, line)) continue;
+				
+				// Memory-only nodes have no cpus to bind to
+				auto cpus = bs_ParseCpuList(line);
+				if (cpus.empty()) continue;
+				
+				nodeIds.push_back((int)id);
+				nodeCpus.push_back(std::move(cpus));
+			}
+		}
+#endif
+		
+		if (nodeCpus.empty()) {
+			nodeIds = { 0 };
+			nodeCpus.assign(1, {});
+		}
+	}
+	
+	inline int NumaTopology::IndexOf(int id) const
+	{
+		auto itr = std::find(nodeIds.begin(), nodeIds.end(), id);
+		return itr != nodeIds.end() ? (int)std::distance(nodeIds.begin(), itr) : -1;
+	}
+	
+	inline const NumaTopology& NumaTopology::get()
+	{
+		static NumaTopology s {};
+		return s;
+	}
+	
+	inline NodeBinding::NodeBinding(int node)
+	{
+#ifdef __linux__
+		const NumaTopology& topo = NumaTopology::get();
+		if (node < 0 || !topo.IsNuma() || (size_t)node >= topo.NodeCount()) return;
+		
+		if (sched_getaffinity(0, sizeof(cpusOld), &cpusOld) != 0) return;
+		
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (size_t cpu : topo.GetCpus(node)) {
+			if (cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &cpus);
+		}
+		
+		bBound = sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#endif
+	}
+	inline NodeBinding::~NodeBinding()
+	{
+#ifdef __linux__
+		if (bBound)
+			sched_setaffinity(0, sizeof(cpusOld), &cpusOld);
+#endif
+	}
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+// ------------------------------------------------------------------------------
+
+namespace btreesort {
+	// Names of the key types a tuning profile can hold entries for
+	template<typename T> constexpr const char* bs_TypeTag = nullptr;
+	template<> constexpr const char* bs_TypeTag<int8_t> = "i8";
+	template<> constexpr const char* bs_TypeTag<uint8_t> = "u8";
+	template<> constexpr const char* bs_TypeTag<int16_t> = "i16";
+	template<> constexpr const char* bs_TypeTag<uint16_t> = "u16";
+	template<> constexpr const char* bs_TypeTag<int32_t> = "i32";
+	template<> constexpr const char* bs_TypeTag<uint32_t> = "u32";
+	template<> constexpr const char* bs_TypeTag<int64_t> = "i64";
+	template<> constexpr const char* bs_TypeTag<uint64_t> = "u64";
+	template<> constexpr const char* bs_TypeTag<double> = "f64";
+	
+	// Tuned parameters for sorting at least [nMinCount] elements of one type
+	struct TuningEntry {
+		std::string type;
+		size_t nMinCount;
+		
+		size_t nSubBuckets;
+		size_t nMinPerSlice;
+	};
+	
+	// Text file of tuning entries, one per line:
+	//    type minCount nSubBuckets nMinPerSlice
+	// Lines starting with # are comments
+	class TuningProfile {
+		std::vector<TuningEntry> entries;
+	public:
+		TuningProfile() = default;
+		
+		bool Load(const std::string& path);
+		bool Save(const std::string& path) const;
+		
+		void Add(const TuningEntry& entry);
+		
+		// Entry of the largest size class not above [count], or null if there's none
+		const TuningEntry* Find(const char* type, size_t count) const;
+		
+		bool Empty() const { return entries.empty(); }
+		
+		// Loaded once from the file named by $BTREESORT_PROFILE,
+		//    or btreesort.profile in the working directory
+		static const TuningProfile& get();
+	};
+	
+	// ------------------------------------------------------------------------------
+	
+	inline bool TuningProfile::Load(const std::string& path)
+	{
+		std::ifstream file(path);
+		if (!file.is_open())
+			return false;
+		
+		std::string line;
+		while (std::getline(file, line)) {
+			if (line.empty() || line[0] == '#') continue;
+			
+			TuningEntry e {};
+			std::istringstream ss(line);
+			if (ss >> e.type >> e.nMinCount >> e.nSubBuckets >> e.nMinPerSlice) {
+				// Zeros would make the sorter divide by zero, skip such lines
+				if (e.nSubBuckets > 0 && e.nMinPerSlice > 0)
+					Add(e);
+			}
+		}
+		
+		return true;
+	}
+	inline bool TuningProfile::Save(const std::string& path) const
+	{
+		std::ofstream file(path);
+		if (!file.is_open())
+			return false;
+		
+		file << "# type minCount nSubBuckets nMinPerSlice\n";
+		for (auto& e : entries) {
+			file << e.type << ' ' << e.nMinCount << ' ' << e.nSubBuckets << ' ' 
+				<< e.nMinPerSlice << '\n';
+		}
+		
+		return file.good();
+	}
+	
+	inline void TuningProfile::Add(const TuningEntry& entry)
+	{
+		// Kept ordered by type then size class, a repeated size class replaces the old one
+		auto _Less = [](const TuningEntry& a, const TuningEntry& b) {
+			if (a.type != b.type)
+				return a.type < b.type;
+			return a.nMinCount < b.nMinCount;
+		};
+		
+		auto itr = std::lower_bound(entries.begin(), entries.end(), entry, _Less);
+		if (itr != entries.end() && !_Less(entry, *itr))
+			*itr = entry;
+		else
+			entries.insert(itr, entry);
+	}
+	
+	inline const TuningEntry* TuningProfile::Find(const char* type, size_t count) const
+	{
+		if (type == nullptr) return nullptr;
+		
+		const TuningEntry* res = nullptr;
+		for (auto& e : entries) {
+			if (e.type == type && e.nMinCount <= count)
+				res = &e;
+		}
+		return res;
+	}
+	
+	inline const TuningProfile& TuningProfile::get()
+	{
+		static TuningProfile s = [] {
+			TuningProfile p;
+			
+			const char* path = std::getenv("BTREESORT_PROFILE");
+			p.Load(path ? path : "btreesort.profile");
+			
+			return p;
+		}();
+		return s;
+	}
+}
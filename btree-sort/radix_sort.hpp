@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <array>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+#include "algo.hpp"
+#include "executor.hpp"
+#include "memory.hpp"
+
+// ------------------------------------------------------------------------------
+
+namespace btreesort {
+	constexpr size_t BS_RADIX_BITS = 8;
+	constexpr size_t BS_RADIX_SIZE = 1 << BS_RADIX_BITS;
+	
+	// Buckets at most this large are finished with bs_QuickSort instead of more radix passes
+	constexpr size_t BS_RADIX_SMALL = 512;
+	
+	// LSD passes only run on buckets that fit in cache, larger ones get another MSD pass first
+	constexpr size_t BS_RADIX_LSD_MAX = 1 << 16;
+	
+	// Maps keys to unsigned integers whose unsigned order matches std::less on the keys
+	template<typename T> struct bs_RadixTraits {};
+	template<> struct bs_RadixTraits<uint32_t> {
+		using Key = uint32_t;
+		static Key ToKey(uint32_t x) { return x; }
+	};
+	template<> struct bs_RadixTraits<int32_t> {
+		using Key = uint32_t;
+		static Key ToKey(int32_t x) { return (Key)x ^ ((Key)1 << 31); }
+	};
+	template<> struct bs_RadixTraits<uint64_t> {
+		using Key = uint64_t;
+		static Key ToKey(uint64_t x) { return x; }
+	};
+	template<> struct bs_RadixTraits<int64_t> {
+		using Key = uint64_t;
+		static Key ToKey(int64_t x) { return (Key)x ^ ((Key)1 << 63); }
+	};
+	template<> struct bs_RadixTraits<double> {
+		using Key = uint64_t;
+		static Key ToKey(double x)
+		{
+			// Negative: flip everything so larger magnitudes sort first
+			// Positive: set the sign bit so they sort after all negatives
+			Key bits;
+			memcpy(&bits, &x, sizeof(bits));
+			Key mask = (Key)0 - (bits >> 63);
+			return bits ^ (mask | ((Key)1 << 63));
+		}
+	};
+	
+	// Iterators over one contiguous array, which the radix passes address through a pointer
+	template<typename Iter, typename ValType = typename std::iterator_traits<Iter>::value_type>
+	constexpr bool bs_IsContiguous =
+#if __cplusplus >= 202002L
+		std::contiguous_iterator<Iter>;
+#else
+		std::is_pointer_v<Iter> ||
+		std::is_same_v<Iter, typename std::vector<ValType>::iterator> ||
+		std::is_same_v<Iter, typename Buffer<ValType>::iterator>;
+#endif
+	
+	// Other ranges fall back to the comparison engine
+	template<typename Iter, typename Comparator,
+		typename ValType = typename std::iterator_traits<Iter>::value_type>
+	constexpr bool bs_HasRadixSort = bs_IsContiguous<Iter> &&
+		(std::is_same_v<ValType, int32_t> || std::is_same_v<ValType, uint32_t> ||
+			std::is_same_v<ValType, int64_t> || std::is_same_v<ValType, uint64_t> ||
+			std::is_same_v<ValType, double>) &&
+		(std::is_same_v<Comparator, std::less<ValType>> ||
+			std::is_same_v<Comparator, std::less<>>);
+	
+	template<typename T>
+	inline size_t bs_RadixDigit(const T& x, size_t iDigit)
+	{
+		auto key = bs_RadixTraits<T>::ToKey(x);
+		return (key >> (iDigit * BS_RADIX_BITS)) & (BS_RADIX_SIZE - 1);
+	}
+	
+	// Stable scatter of [src, src + n) into [dst] by digit, [offsets] is advanced past every
+	//    written element
+	// Elements are staged in a cache line per digit and written out a full line at a time,
+	//    so the 256 output streams don't thrash the cache and TLB
+	template<typename T>
+	void bs_RadixScatter(const T* src, size_t n, T* dst, size_t* offsets, size_t iDigit)
+	{
+		constexpr size_t LINE = std::max<size_t>(64 / sizeof(T), 1);
+		
+		alignas(64) T lines[BS_RADIX_SIZE][LINE];
+		uint8_t fill[BS_RADIX_SIZE] = {};
+		
+		for (size_t i = 0; i < n; ++i) {
+			size_t d = bs_RadixDigit(src[i], iDigit);
+			
+			lines[d][fill[d]++] = src[i];
+			if (fill[d] == LINE) {
+				memcpy(dst + offsets[d], lines[d], sizeof(lines[d]));
+				offsets[d] += LINE;
+				fill[d] = 0;
+			}
+		}
+		
+		for (size_t d = 0; d < BS_RADIX_SIZE; ++d) {
+			memcpy(dst + offsets[d], lines[d], fill[d] * sizeof(T));
+			offsets[d] += fill[d];
+		}
+	}
+	
+	// Single-threaded radix sort of [pIn, pIn + n) on its lowest [nDigits] digits
+	// [pOther] is scratch of the same size, the result ends up in [pOut], which is one of the two
+	template<typename T>
+	void bs_RadixSortSerial(T* pIn, T* pOther, size_t n, size_t nDigits, T* pOut)
+	{
+		if (n <= BS_RADIX_SMALL || nDigits == 0) {
+			if (pOut != pIn)
+				std::copy(pIn, pIn + n, pOut);
+			if (nDigits > 0)
+				bs_QuickSort(pOut, pOut + n, std::less<T>(), BS_NETWORK_SORT_MAX / 2);
+			return;
+		}
+		
+		if (n > BS_RADIX_LSD_MAX && nDigits > 1) {
+			// Too large to stay in cache, split on the top digit first
+			size_t iDigit = nDigits - 1;
+			
+			size_t offsets[BS_RADIX_SIZE] = {};
+			for (size_t i = 0; i < n; ++i) {
+				++offsets[bs_RadixDigit(pIn[i], iDigit)];
+			}
+			
+			size_t starts[BS_RADIX_SIZE + 1];
+			size_t sum = 0;
+			for (size_t d = 0; d < BS_RADIX_SIZE; ++d) {
+				starts[d] = sum;
+				sum += offsets[d];
+				offsets[d] = starts[d];
+			}
+			starts[BS_RADIX_SIZE] = sum;
+			
+			bs_RadixScatter(pIn, n, pOther, offsets, iDigit);
+			
+			for (size_t d = 0; d < BS_RADIX_SIZE; ++d) {
+				size_t begin = starts[d];
+				bs_RadixSortSerial(pOther + begin, pIn + begin, starts[d + 1] - begin, iDigit, 
+					pOut + begin);
+			}
+			return;
+		}
+		
+		// All histograms in one read
+		std::vector<std::array<size_t, BS_RADIX_SIZE>> counts(nDigits);
+		for (auto& c : counts) c.fill(0);
+		
+		for (size_t i = 0; i < n; ++i) {
+			auto key = bs_RadixTraits<T>::ToKey(pIn[i]);
+			for (size_t iDigit = 0; iDigit < nDigits; ++iDigit) {
+				++counts[iDigit][(key >> (iDigit * BS_RADIX_BITS)) & (BS_RADIX_SIZE - 1)];
+			}
+		}
+		
+		T* pSrc = pIn;
+		T* pDst = pOther;
+		
+		for (size_t iDigit = 0; iDigit < nDigits; ++iDigit) {
+			auto& count = counts[iDigit];
+			
+			// Every element has the same digit, nothing would move
+			if (count[bs_RadixDigit(pSrc[0], iDigit)] == n) continue;
+			
+			size_t offsets[BS_RADIX_SIZE];
+			size_t sum = 0;
+			for (size_t d = 0; d < BS_RADIX_SIZE; ++d) {
+				offsets[d] = sum;
+				sum += count[d];
+			}
+			
+			bs_RadixScatter(pSrc, n, pDst, offsets, iDigit);
+			std::swap(pSrc, pDst);
+		}
+		
+		if (pSrc != pOut)
+			std::copy(pSrc, pSrc + n, pOut);
+	}
+	
+	// Parallel stable partition of [pIn, pIn + n) into [pOther] by digit [iDigit]
+	// [starts] receives the begin offset of every bucket plus the end
+	template<typename T>
+	void bs_RadixPartition(T* pIn, T* pOther, size_t n, size_t iDigit, size_t nThreads,
+		std::array<size_t, BS_RADIX_SIZE + 1>& starts, Executor& exec)
+	{
+		std::vector<std::array<size_t, BS_RADIX_SIZE>> offsets(nThreads);
+		
+		auto _ChunkBegin = [&](size_t t) { return n * t / nThreads; };
+		
+		exec.ParallelFor(nThreads, nThreads, [&](size_t t) {
+			auto& count = offsets[t];
+			count.fill(0);
+			
+			for (size_t i = _ChunkBegin(t); i < _ChunkBegin(t + 1); ++i) {
+				++count[bs_RadixDigit(pIn[i], iDigit)];
+			}
+		});
+		
+		// Bucket-major, then thread-major, so each thread writes its own part of every bucket
+		size_t sum = 0;
+		for (size_t d = 0; d < BS_RADIX_SIZE; ++d) {
+			starts[d] = sum;
+			for (size_t t = 0; t < nThreads; ++t) {
+				size_t count = offsets[t][d];
+				offsets[t][d] = sum;
+				sum += count;
+			}
+		}
+		starts[BS_RADIX_SIZE] = sum;
+		
+		exec.ParallelFor(nThreads, nThreads, [&](size_t t) {
+			size_t begin = _ChunkBegin(t);
+			bs_RadixScatter(pIn + begin, _ChunkBegin(t + 1) - begin, pOther,
+				offsets[t].data(), iDigit);
+		});
+	}
+	
+	// MSD radix sort, partitions on [iDigit] then sorts every bucket on the lower digits
+	// Buckets larger than [nPerThread] are partitioned again with all threads,
+	//    the rest are radix sorted one bucket per thread
+	template<typename T>
+	void bs_RadixSortMsd(T* pIn, T* pOther, size_t n, size_t iDigit, size_t nThreads,
+		size_t nPerThread, T* pOut, Executor& exec)
+	{
+		std::array<size_t, BS_RADIX_SIZE + 1> starts;
+		bs_RadixPartition(pIn, pOther, n, iDigit, nThreads, starts, exec);
+		
+		// Buckets now live in pOther
+		std::vector<size_t> small;
+		small.reserve(BS_RADIX_SIZE);
+		
+		for (size_t d = 0; d < BS_RADIX_SIZE; ++d) {
+			size_t begin = starts[d];
+			size_t count = starts[d + 1] - begin;
+			if (count == 0) continue;
+			
+			if (count > nPerThread && iDigit > 0) {
+				bs_RadixSortMsd(pOther + begin, pIn + begin, count, iDigit - 1,
+					nThreads, nPerThread, pOut + begin, exec);
+			}
+			else {
+				small.push_back(d);
+			}
+		}
+		
+		exec.ParallelFor(small.size(), nThreads, [&](size_t i) {
+			size_t begin = starts[small[i]];
+			size_t count = starts[small[i] + 1] - begin;
+			bs_RadixSortSerial(pOther + begin, pIn + begin, count, iDigit, pOut + begin);
+		});
+	}
+	
+	// Parallel radix sort of a contiguous range of keys in std::less order
+	// [pBuffer] is scratch of the same size, allocated here if null
+	// With [bIntoBuffer] the result is left in [pBuffer] and the range is left unordered
+	template<typename Iter, typename ValType = typename std::iterator_traits<Iter>::value_type>
+	void bs_RadixSort(Iter begin, Iter end, size_t nThreads, 
+		ValType* pBuffer = nullptr, bool bIntoBuffer = false, Executor& exec = Executor::Default())
+	{
+		static_assert(bs_IsContiguous<Iter>, "bs_RadixSort addresses the range through a pointer");
+		
+		using Key = typename bs_RadixTraits<ValType>::Key;
+		
+		size_t n = std::distance(begin, end);
+		ValType* pData = n > 0 ? &*begin : nullptr;
+		
+		// Digits above the highest bit where the keys differ are common to all keys, skip them
+		std::vector<std::array<Key, 2>> masks(nThreads, { 0, ~(Key)0 });
+		exec.ParallelFor(nThreads, nThreads, [&](size_t t) {
+			auto& [keyOr, keyAnd] = masks[t];
+			for (size_t i = n * t / nThreads; i < n * (t + 1) / nThreads; ++i) {
+				Key key = bs_RadixTraits<ValType>::ToKey(pData[i]);
+				keyOr |= key;
+				keyAnd &= key;
+			}
+		});
+		
+		Key keyOr = 0, keyAnd = ~(Key)0;
+		for (auto& [o, a] : masks) {
+			keyOr |= o;
+			keyAnd &= a;
+		}
+		
+		Key diff = keyOr ^ keyAnd;
+		if (n < 2 || diff == 0) {
+			if (bIntoBuffer)
+				std::copy(pData, pData + n, pBuffer);
+			return;
+		}
+		
+		size_t iDigit = 0;
+		while ((diff >> (iDigit * BS_RADIX_BITS)) >= BS_RADIX_SIZE)
+			++iDigit;
+		
+		Buffer<ValType> buffer;
+		if (pBuffer == nullptr) {
+			buffer.resize(n);
+			pBuffer = buffer.data();
+		}
+		
+		size_t nPerThread = (n + nThreads - 1) / nThreads;
+		bs_RadixSortMsd(pData, pBuffer, n, iDigit, nThreads, nPerThread, 
+			bIntoBuffer ? pBuffer : pData, exec);
+	}
+}
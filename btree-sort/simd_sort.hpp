@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+// ------------------------------------------------------------------------------
+
+//#define NO_NETWORK_SORT
+
+// The network is written with GCC vector extensions and compiled once per instruction set,
+//    target_clones then picks the AVX-512, AVX2 or baseline clone at load time
+#if !defined(NO_NETWORK_SORT) && defined(__GNUC__) && !defined(__clang__) && \
+	defined(__x86_64__) && defined(__linux__)
+	#define BS_NETWORK_SORT
+	#define BS_NETWORK_TARGETS __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+
+// ------------------------------------------------------------------------------
+
+namespace btreesort {
+	constexpr size_t BS_NETWORK_SORT_MIN = 16;
+	constexpr size_t BS_NETWORK_SORT_MAX = 256;
+
+	// Key types the sorting network supports, ordered by std::less only
+	template<typename Iter, typename Comparator,
+		typename ValType = typename std::iterator_traits<Iter>::value_type>
+	constexpr bool bs_HasNetworkSort =
+#ifdef BS_NETWORK_SORT
+		(std::is_same_v<ValType, int32_t> || std::is_same_v<ValType, uint32_t> ||
+			std::is_same_v<ValType, int64_t> || std::is_same_v<ValType, uint64_t> ||
+			std::is_same_v<ValType, double>) &&
+		(std::is_same_v<Comparator, std::less<ValType>> ||
+			std::is_same_v<Comparator, std::less<>>);
+#else
+		false;
+#endif
+
+#ifdef BS_NETWORK_SORT
+	// Bitonic sorting network over [n] elements, [n] must be a power of 2 and at least 16
+	// Compare-exchanges between lanes of one vector go through a lane permute,
+	//    ones between different vectors are plain vertical min/max
+	// Everything stays in this one function, vector values must not cross into
+	//    functions compiled for another instruction set
+	template<typename T>
+	BS_NETWORK_TARGETS void bs_BitonicSortBlock(T* buf, size_t n)
+	{
+		constexpr size_t VEC_BYTES = 64;
+		constexpr size_t W = VEC_BYTES / sizeof(T);
+
+		using Lane = std::conditional_t<sizeof(T) == 4, int32_t, int64_t>;
+		typedef T VecT __attribute__((vector_size(VEC_BYTES)));
+		typedef Lane VecI __attribute__((vector_size(VEC_BYTES)));
+
+		VecI iota;
+		for (size_t l = 0; l < W; ++l)
+			iota[l] = (Lane)l;
+
+		for (size_t k = 2; k <= n; k <<= 1) {
+			for (size_t j = k >> 1; j > 0; j >>= 1) {
+				if (j >= W) {
+					// Partner is a whole vector away, the direction is uniform across lanes
+					for (size_t i = 0; i < n; i += W) {
+						if (i & j) continue;
+
+						VecT a, b;
+						memcpy(&a, buf + i, VEC_BYTES);
+						memcpy(&b, buf + i + j, VEC_BYTES);
+
+						VecT lo = a < b ? a : b;
+						VecT hi = a < b ? b : a;
+
+						if ((i & k) == 0) {
+							memcpy(buf + i, &lo, VEC_BYTES);
+							memcpy(buf + i + j, &hi, VEC_BYTES);
+						}
+						else {
+							memcpy(buf + i, &hi, VEC_BYTES);
+							memcpy(buf + i + j, &lo, VEC_BYTES);
+						}
+					}
+				}
+				else {
+					// Partner is lane ^ j, a lane keeps the min if it's the lower one of
+					//    an ascending pair or the upper one of a descending pair
+					VecI perm = iota ^ (Lane)j;
+					VecI lower = (iota & (Lane)j) == 0;
+
+					for (size_t i = 0; i < n; i += W) {
+						VecI ascending = ((iota + (Lane)i) & (Lane)k) == 0;
+						VecI takeMin = lower == ascending;
+
+						VecT a;
+						memcpy(&a, buf + i, VEC_BYTES);
+						VecT b = __builtin_shuffle(a, perm);
+
+						VecT lo = a < b ? a : b;
+						VecT hi = a < b ? b : a;
+						VecT res = takeMin ? lo : hi;
+
+						memcpy(buf + i, &res, VEC_BYTES);
+					}
+				}
+			}
+		}
+	}
+#endif
+
+	// Sorts up to BS_NETWORK_SORT_MAX elements with the bitonic network,
+	//    padding up to the next power of 2 with the largest key
+	template<typename Iter>
+	void bs_NetworkSort(Iter begin, Iter end)
+	{
+#ifdef BS_NETWORK_SORT
+		using ValType = typename std::iterator_traits<Iter>::value_type;
+
+		size_t size = std::distance(begin, end);
+
+		size_t n = BS_NETWORK_SORT_MIN;
+		while (n < size) n <<= 1;
+
+		constexpr ValType pad = std::numeric_limits<ValType>::has_infinity ?
+			std::numeric_limits<ValType>::infinity() : std::numeric_limits<ValType>::max();
+
+		alignas(64) ValType buf[BS_NETWORK_SORT_MAX];
+		std::copy(begin, end, buf);
+		std::fill(buf + size, buf + n, pad);
+
+		bs_BitonicSortBlock(buf, n);
+
+		std::copy(buf, buf + size, begin);
+#endif
+	}
+}
@@ -2,6 +2,7 @@
 
 #include <fstream>
 #include <cstdint>
+#include <type_traits>
 
 FileReader::FileReader() : FileReader("", false) {}
 FileReader::FileReader(const std::string& path, bool binary) : 
@@ -10,8 +11,15 @@ FileReader::FileReader(const std::string& path, bool binary) :
 // ------------------------------------------------------------------------------
 
 // Explicit template instantiations
-#define ITEMPL_ReadData(_ty) template std::vector<_ty> FileReader::ReadData<_ty>() const;
+#define ITEMPL_ReadData(_ty) \
+	template std::vector<_ty> FileReader::ReadData<_ty>() const; \
+	template size_t FileReader::GetDataCount<_ty>() const; \
+	template void FileReader::ReadData<_ty>(_ty* pDest, size_t count) const;
 
+ITEMPL_ReadData(int8_t);
+ITEMPL_ReadData(uint8_t);
+ITEMPL_ReadData(int16_t);
+ITEMPL_ReadData(uint16_t);
 ITEMPL_ReadData(int32_t);
 ITEMPL_ReadData(uint32_t);
 ITEMPL_ReadData(int64_t);
@@ -20,53 +28,69 @@ ITEMPL_ReadData(double);
 
 template<typename T> std::vector<T> FileReader::ReadData() const
 {
-	std::ifstream file(path, binary ? std::ios::binary : (std::ios::openmode)0);
+	std::vector<T> res;
+
+	if (binary) {
+		res.resize(GetDataCount<T>());
+		ReadData(res.data(), res.size());
+		return res;
+	}
+
+	std::ifstream file(path);
 	if (!file.is_open())
 		throw std::string("Failed to open file for reading");
 
-	file.seekg(0, std::ios::end);
-	size_t fileSize = file.tellg();
-	file.seekg(0, std::ios::beg);
+	// Use file exceptions instead of putting checks inside the read loop
+	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 
-	std::vector<T> res;
+	// 8-bit integers would be read as characters, read them as int
+	using ReadType = std::conditional_t<sizeof(T) == 1, int, T>;
 
-	if (binary) {
-		if (fileSize % sizeof(T) != 0)
-			throw std::string("Wrong file size for data type");
-
-		size_t dataCount = fileSize / sizeof(T);
-		res.resize(dataCount);
-
-		// Buffered read into res
-		{
-			constexpr size_t MAX_PER_IT = 4096;
-
-			size_t pos = 0;
-			size_t remain = dataCount;
-			while (remain > 0) {
-				size_t read = std::min(MAX_PER_IT, remain);
-				file.read((char*)&res[pos], read * sizeof(T));
-				
-				pos += read;
-				remain -= read;
-			}
+	try {
+		ReadType value;
+		while (file >> value) {
+			res.push_back((T)value);
 		}
 	}
-	else {
-		// Use file exceptions instead of putting checks inside the read loop
-		file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-
-		try {
-			T value;
-			while (file >> value) {
-				res.push_back(value);
-			}
-		}
-		catch (const std::ifstream::failure& e) {
-			//throw (std::string("File read error: ") + e.what());
-		}
+	catch (const std::ifstream::failure& e) {
+		//throw (std::string("File read error: ") + e.what());
 	}
 
 	file.close();
 	return res;
+}
+
+template<typename T> size_t FileReader::GetDataCount() const
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+		throw std::string("Failed to open file for reading");
+
+	size_t fileSize = file.tellg();
+	if (fileSize % sizeof(T) != 0)
+		throw std::string("Wrong file size for data type");
+
+	return fileSize / sizeof(T);
+}
+
+template<typename T> void FileReader::ReadData(T* pDest, size_t count) const
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		throw std::string("Failed to open file for reading");
+
+	// Buffered read into pDest
+	constexpr size_t MAX_PER_IT = 4096;
+
+	size_t pos = 0;
+	size_t remain = count;
+	while (remain > 0) {
+		size_t read = std::min(MAX_PER_IT, remain);
+		file.read((char*)&pDest[pos], read * sizeof(T));
+		
+		pos += read;
+		remain -= read;
+	}
+
+	file.close();
 }
\ No newline at end of file
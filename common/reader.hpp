@@ -12,4 +12,8 @@ public:
 	FileReader(const std::string& path, bool binary);
 	
 	template<typename T> std::vector<T> ReadData() const;
+	
+	// Binary files only, so the caller can place its own buffer before reading into it
+	template<typename T> size_t GetDataCount() const;
+	template<typename T> void ReadData(T* pDest, size_t count) const;
 };
@@ -8,6 +8,10 @@
 #endif
 
 enum class DataType {
+	i8,
+	u8,
+	i16,
+	u16,
 	i32,
 	u32,
 	i64,
@@ -19,7 +23,11 @@ static DataType GetDataTypeFromString(char* type)
 {
 #define CHECK(_chk, _res) if (strcmpi(type, _chk) == 0) return _res
 	
-	CHECK("i32", DataType::i32);
+	CHECK("i8", DataType::i8);
+	else CHECK("u8", DataType::u8);
+	else CHECK("i16", DataType::i16);
+	else CHECK("u16", DataType::u16);
+	else CHECK("i32", DataType::i32);
 	else CHECK("u32", DataType::u32);
 	else CHECK("i64", DataType::i64);
 	else CHECK("u64", DataType::u64);
@@ -64,6 +72,7 @@ enum class SortType {
 	MultiwayMerge,
 	BalancedQuick,
 	BTreeMerge,
+	BTreeRadix,
 	Invalid,
 };
 static SortType GetSortTypeFromString(char* type)
@@ -79,6 +88,9 @@ static SortType GetSortTypeFromString(char* type)
 	else CHECK("bt", SortType::BTreeMerge);
 	else CHECK("btree", SortType::BTreeMerge);
 
+	else CHECK("rx", SortType::BTreeRadix);
+	else CHECK("radix", SortType::BTreeRadix);
+
 	return SortType::Invalid;
 
 #undef CHECK
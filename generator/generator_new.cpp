@@ -53,7 +53,7 @@ string binaryOutput = "";
 void PrintHelp()
 {
 	printf("Arguments: N [, DataType [, Arrangement]] [option...]\n");
-	printf("    DataType can be:    i32, u32, i64, u64, f64\n");
+	printf("    DataType can be:    i8, u8, i16, u16, i32, u32, i64, u64, f64\n");
 	printf("    Arrangement can be: random, reversed, fewunique, nsorted\n");
 	printf("    Option can be:\n");
 	printf("        -b file         Output as binary to file\n");
@@ -108,6 +108,18 @@ int main(int argc, char** argv)
 void GenerateDataFromType(size_t count, DataType type, DataArrangeType arrangement)
 {
 	switch (type) {
+	case DataType::i8:
+		GenerateDataFromArrangement<int8_t>(count, arrangement);
+		break;
+	case DataType::u8:
+		GenerateDataFromArrangement<uint8_t>(count, arrangement);
+		break;
+	case DataType::i16:
+		GenerateDataFromArrangement<int16_t>(count, arrangement);
+		break;
+	case DataType::u16:
+		GenerateDataFromArrangement<uint16_t>(count, arrangement);
+		break;
 	case DataType::i32:
 		GenerateDataFromArrangement<int32_t>(count, arrangement);
 		break;
@@ -129,6 +141,30 @@ void GenerateDataFromType(size_t count, DataType type, DataArrangeType arrangeme
 
 // ------------------------------------------------------------------------------
 
+template<> class DataGenerator<int8_t> {
+	std::mt19937 mt;
+public:
+	DataGenerator() : mt((uint64_t)time(nullptr)) {}
+	int8_t operator()() { return (int8_t)mt(); }
+};
+template<> class DataGenerator<uint8_t> {
+	std::mt19937 mt;
+public:
+	DataGenerator() : mt((uint64_t)time(nullptr)) {}
+	uint8_t operator()() { return (uint8_t)mt(); }
+};
+template<> class DataGenerator<int16_t> {
+	std::mt19937 mt;
+public:
+	DataGenerator() : mt((uint64_t)time(nullptr)) {}
+	int16_t operator()() { return (int16_t)mt(); }
+};
+template<> class DataGenerator<uint16_t> {
+	std::mt19937 mt;
+public:
+	DataGenerator() : mt((uint64_t)time(nullptr)) {}
+	uint16_t operator()() { return (uint16_t)mt(); }
+};
 template<> class DataGenerator<int32_t> {
 	std::mt19937 mt;
 public:
@@ -184,8 +220,9 @@ template<typename T> void GenerateDataFromArrangement(size_t count, DataArrangeT
 	
 	{
 		if (binaryOutput.empty()) {
+			// Unary plus prints 8-bit integers as numbers rather than characters
 			for (const T& i : data) {
-				std::cout << i << " ";
+				std::cout << +i << " ";
 			}
 		}
 		else {
@@ -0,0 +1,75 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <random>
+#include <algorithm>
+#include <functional>
+
+#include "btree_sort.hpp"
+
+using std::vector;
+using std::string;
+
+using btreesort::BTreeSort;
+using btreesort::Settings;
+using btreesort::SortEngine;
+
+// ------------------------------------------------------------------------------
+
+static size_t nFailed = 0;
+
+// Sorts a copy of [data] in a [Container] with BTreeSort and compares it with std::sort
+template<typename Container, typename T> void Check(const char* name, const vector<T>& data, 
+	const Settings& settings, SortEngine engine)
+{
+	Container res(data.begin(), data.end());
+	vector<T> ref = data;
+	std::sort(ref.begin(), ref.end());
+
+	BTreeSort<typename Container::iterator, std::less<T>> sorter(res.begin(), res.end(), settings);
+	sorter.Sort(engine);
+
+	if (!std::equal(res.begin(), res.end(), ref.begin(), ref.end())) {
+		printf("FAILED: %s, %zu elements\n", name, data.size());
+		++nFailed;
+	}
+}
+
+template<typename T, typename F> void CheckSizes(const char* name, F fnMake)
+{
+	// Low cutoff, so small inputs go through the buckets and the merge as well
+	Settings settings(4);
+	settings.nParallelCutoff = 16;
+
+	std::mt19937_64 rng(42);
+	for (size_t count : { 0, 1, 2, 17, 1000, 100000 }) {
+		vector<T> data(count);
+		for (auto& x : data) x = fnMake(rng);
+
+		for (SortEngine engine : { SortEngine::Comparison, SortEngine::Radix }) {
+			Check<vector<T>>(name, data, settings, engine);
+			Check<vector<T>>(name, data, Settings::get(), engine);
+
+			// Not contiguous, the radix engine falls back to the comparison engine
+			Check<std::deque<T>>(name, data, settings, engine);
+		}
+	}
+}
+
+// ------------------------------------------------------------------------------
+
+int main()
+{
+	CheckSizes<int>("int", [](std::mt19937_64& rng) { return (int)rng(); });
+	CheckSizes<double>("double", [](std::mt19937_64& rng) { return (double)(rng() % 1000) / 7.0; });
+
+	// Not trivially copyable, merged through the ordered set instead of the loser tree
+	CheckSizes<string>("string", [](std::mt19937_64& rng) { return std::to_string(rng() % 10000) + "k"; });
+
+	if (nFailed > 0)
+		return 1;
+
+	printf("All tests passed\n");
+	return 0;
+}